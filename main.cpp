@@ -2,16 +2,54 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
 #include <thread>
 #include <mutex>
+#include <map>
 #include <queue>
+#include <deque>
+#include <random>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <regex>
 #include <curl/curl.h>
+#include <filesystem>
+#include <sstream>
 #include <chrono>
 #include <iomanip>
 #include <condition_variable>
 #include <functional>
 #include <atomic>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <limits>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 class CurlHandle {
 public:
@@ -96,9 +134,16 @@ public:
         }
     }
 
+    // Progress messages go to stdout by default; streaming mode moves them to
+    // stderr so stdout carries only JSON results.
+    void setConsole(std::ostream& console) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        console_ = &console;
+    }
+
     void log(const std::string& message) {
         std::lock_guard<std::mutex> lock(mtx_);
-        std::cout << message << std::endl;
+        *console_ << message << std::endl;
         if (logFile_.is_open()) {
             logFile_ << message << std::endl;
         }
@@ -122,27 +167,769 @@ private:
     Logger() = default;
     std::mutex mtx_;
     std::ofstream logFile_;
+    std::ostream* console_ = &std::cout;
+};
+
+
+#ifdef DOWNLOADER_TRACING
+constexpr bool kTracingEnabled = true;
+#else
+constexpr bool kTracingEnabled = false;
+#endif
+
+std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    escaped.reserve(text.size() + 2);
+    for (unsigned char c : text) {
+        switch (c) {
+        case '"': escaped += "\\\""; break;
+        case '\\': escaped += "\\\\"; break;
+        case '\n': escaped += "\\n"; break;
+        case '\r': escaped += "\\r"; break;
+        case '\t': escaped += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                escaped += buf;
+            } else {
+                escaped += static_cast<char>(c);
+            }
+        }
+    }
+    return escaped;
+}
+
+// Minimal JSON reader for structured input lines. Numbers keep their source
+// text so they can be written back unchanged.
+struct JsonValue {
+    enum class Type { Null, Bool, Number, String, Array, Object };
+
+    Type type = Type::Null;
+    bool boolean = false;
+    std::string text;  // String contents, or a Number's literal
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    const JsonValue* find(std::string_view key) const {
+        for (const auto& member : members) {
+            if (member.first == key) return &member.second;
+        }
+        return nullptr;
+    }
+
+    std::string serialize() const {
+        switch (type) {
+        case Type::Null: return "null";
+        case Type::Bool: return boolean ? "true" : "false";
+        case Type::Number: return text;
+        case Type::String: return "\"" + jsonEscape(text) + "\"";
+        case Type::Array: {
+            std::string out = "[";
+            for (size_t i = 0; i < items.size(); ++i) out += (i ? "," : "") + items[i].serialize();
+            return out + "]";
+        }
+        case Type::Object: {
+            std::string out = "{";
+            for (size_t i = 0; i < members.size(); ++i) {
+                out += (i ? ",\"" : "\"") + jsonEscape(members[i].first) + "\":" + members[i].second.serialize();
+            }
+            return out + "}";
+        }
+        }
+        return "null";
+    }
+};
+
+class JsonParser {
+public:
+    // Parses exactly one value (surrounding whitespace allowed).
+    static bool parse(std::string_view input, JsonValue& value, std::string& error) {
+        JsonParser parser(input);
+        if (!parser.parseValue(value, 0) || (parser.skipSpace(), parser.pos_ != input.size())) {
+            error = parser.error_.empty() ? "trailing characters" : parser.error_;
+            error += " at offset " + std::to_string(parser.pos_);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    explicit JsonParser(std::string_view input) : in_(input) {}
+
+    static constexpr int kMaxDepth = 64;
+
+    bool fail(const char* message) {
+        if (error_.empty()) error_ = message;
+        return false;
+    }
+
+    void skipSpace() {
+        while (pos_ < in_.size() && (in_[pos_] == ' ' || in_[pos_] == '\t' || in_[pos_] == '\n' || in_[pos_] == '\r')) ++pos_;
+    }
+
+    bool consume(char c) {
+        skipSpace();
+        if (pos_ < in_.size() && in_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    bool literal(std::string_view word) {
+        if (in_.substr(pos_, word.size()) != word) return fail("invalid literal");
+        pos_ += word.size();
+        return true;
+    }
+
+    bool parseValue(JsonValue& value, int depth) {
+        if (depth > kMaxDepth) return fail("nesting too deep");
+        skipSpace();
+        if (pos_ >= in_.size()) return fail("unexpected end of input");
+        switch (in_[pos_]) {
+        case '{': return parseObject(value, depth);
+        case '[': return parseArray(value, depth);
+        case '"': value.type = JsonValue::Type::String; return parseString(value.text);
+        case 't': value.type = JsonValue::Type::Bool; value.boolean = true; return literal("true");
+        case 'f': value.type = JsonValue::Type::Bool; value.boolean = false; return literal("false");
+        case 'n': value.type = JsonValue::Type::Null; return literal("null");
+        default: return parseNumber(value);
+        }
+    }
+
+    bool parseObject(JsonValue& value, int depth) {
+        value.type = JsonValue::Type::Object;
+        ++pos_;
+        if (consume('}')) return true;
+        do {
+            std::string key;
+            skipSpace();
+            if (pos_ >= in_.size() || in_[pos_] != '"' || !parseString(key)) return fail("expected object key");
+            if (!consume(':')) return fail("expected ':'");
+            value.members.emplace_back(std::move(key), JsonValue());
+            if (!parseValue(value.members.back().second, depth + 1)) return false;
+        } while (consume(','));
+        return consume('}') || fail("expected ',' or '}'");
+    }
+
+    bool parseArray(JsonValue& value, int depth) {
+        value.type = JsonValue::Type::Array;
+        ++pos_;
+        if (consume(']')) return true;
+        do {
+            value.items.emplace_back();
+            if (!parseValue(value.items.back(), depth + 1)) return false;
+        } while (consume(','));
+        return consume(']') || fail("expected ',' or ']'");
+    }
+
+    bool parseNumber(JsonValue& value) {
+        const size_t start = pos_;
+        if (pos_ < in_.size() && in_[pos_] == '-') ++pos_;
+        while (pos_ < in_.size() && (std::isdigit(static_cast<unsigned char>(in_[pos_])) || in_[pos_] == '.' ||
+                                     in_[pos_] == 'e' || in_[pos_] == 'E' || in_[pos_] == '+' || in_[pos_] == '-')) {
+            ++pos_;
+        }
+        if (pos_ == start || !std::isdigit(static_cast<unsigned char>(in_[pos_ - 1]))) return fail("invalid value");
+        value.type = JsonValue::Type::Number;
+        value.text = std::string(in_.substr(start, pos_ - start));
+        return true;
+    }
+
+    bool parseHex4(unsigned& code) {
+        if (pos_ + 4 > in_.size()) return fail("truncated \\u escape");
+        code = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = in_[pos_++];
+            code <<= 4;
+            if (c >= '0' && c <= '9') code |= static_cast<unsigned>(c - '0');
+            else if (c >= 'a' && c <= 'f') code |= static_cast<unsigned>(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') code |= static_cast<unsigned>(c - 'A' + 10);
+            else return fail("invalid \\u escape");
+        }
+        return true;
+    }
+
+    static void appendUtf8(std::string& out, unsigned code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        } else if (code < 0x800) {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    bool parseString(std::string& out) {
+        ++pos_;  // opening quote
+        while (pos_ < in_.size()) {
+            char c = in_[pos_++];
+            if (c == '"') return true;
+            if (static_cast<unsigned char>(c) < 0x20) return fail("control character in string");
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos_ >= in_.size()) break;
+            switch (in_[pos_++]) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned code = 0;
+                if (!parseHex4(code)) return false;
+                if (code >= 0xD800 && code < 0xDC00 && in_.substr(pos_, 2) == "\\u") {
+                    pos_ += 2;
+                    unsigned low = 0;
+                    if (!parseHex4(low)) return false;
+                    if (low < 0xDC00 || low > 0xDFFF) return fail("invalid surrogate pair");
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUtf8(out, code);
+                break;
+            }
+            default: return fail("invalid escape");
+            }
+        }
+        return fail("unterminated string");
+    }
+
+    std::string_view in_;
+    size_t pos_ = 0;
+    std::string error_;
+};
+
+// Collects per-transfer spans and writes them as Chrome trace JSON (loadable
+// in chrome://tracing or ui.perfetto.dev). Build with -DDOWNLOADER_TRACING to
+// enable; otherwise every call site is discarded at compile time through
+// `if constexpr (kTracingEnabled)`.
+class Tracer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static Tracer& getInstance() {
+        static Tracer instance;
+        return instance;
+    }
+
+    Tracer(Tracer const&) = delete;
+    void operator=(Tracer const&) = delete;
+
+    void span(const char* name, const std::string& url, Clock::time_point start, Clock::time_point end) {
+        if (end < start) end = start;
+        ThreadBuffer& buffer = localBuffer();
+        std::lock_guard<std::mutex> lock(buffer.mtx);
+        buffer.events.push_back({name, url, start, end});
+    }
+
+    bool writeChromeTrace(const std::string& filename) {
+        std::ofstream out(filename);
+        if (!out) return false;
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        std::lock_guard<std::mutex> lock(mtx_);
+        Clock::time_point epoch = Clock::time_point::max();
+        for (const auto& buffer : buffers_) {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mtx);
+            for (const Event& event : buffer->events) epoch = std::min(epoch, event.start);
+        }
+        for (const auto& buffer : buffers_) {
+            std::lock_guard<std::mutex> buffer_lock(buffer->mtx);
+            for (const Event& event : buffer->events) {
+                auto ts = std::chrono::duration_cast<std::chrono::microseconds>(event.start - epoch).count();
+                auto dur = std::chrono::duration_cast<std::chrono::microseconds>(event.end - event.start).count();
+                out << (first ? "" : ",") << "\n{\"name\":\"" << event.name << "\",\"cat\":\"download\",\"ph\":\"X\""
+                    << ",\"ts\":" << ts << ",\"dur\":" << dur << ",\"pid\":1,\"tid\":" << buffer->tid
+                    << ",\"args\":{\"url\":\"" << jsonEscape(event.url) << "\"}}";
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+        return static_cast<bool>(out);
+    }
+
+private:
+    struct Event {
+        const char* name;
+        std::string url;
+        Clock::time_point start;
+        Clock::time_point end;
+    };
+
+    // One buffer per thread so recording never contends across workers.
+    struct ThreadBuffer {
+        int tid = 0;
+        std::mutex mtx;
+        std::vector<Event> events;
+    };
+
+    Tracer() = default;
+
+    ThreadBuffer& localBuffer() {
+        thread_local std::shared_ptr<ThreadBuffer> buffer;
+        if (!buffer) {
+            buffer = std::make_shared<ThreadBuffer>();
+            std::lock_guard<std::mutex> lock(mtx_);
+            buffer->tid = static_cast<int>(buffers_.size()) + 1;
+            buffers_.push_back(buffer);
+        }
+        return *buffer;
+    }
+
+    std::mutex mtx_;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+};
+
+// CPUs this process may run on, grouped by NUMA node as reported by sysfs.
+// Falls back to a single node holding the current affinity mask.
+struct CpuTopology {
+    std::vector<int> cpus;       // ordered node by node
+    std::vector<int> cpu_nodes;  // cpu_nodes[i] is the node of cpus[i]
+    int num_nodes = 1;
+
+    static CpuTopology detect() {
+        CpuTopology topology;
+        std::vector<int> allowed = allowedCpus();
+        auto is_allowed = [&](int cpu) {
+            return std::find(allowed.begin(), allowed.end(), cpu) != allowed.end();
+        };
+
+        std::vector<std::pair<int, std::string>> nodes;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+            std::string name = entry.path().filename().string();
+            if (name.rfind("node", 0) != 0 || name.size() == 4 ||
+                name.find_first_not_of("0123456789", 4) != std::string::npos) {
+                continue;
+            }
+            std::ifstream cpulist(entry.path() / "cpulist");
+            std::string list;
+            if (std::getline(cpulist, list)) nodes.emplace_back(std::stoi(name.substr(4)), list);
+        }
+        std::sort(nodes.begin(), nodes.end());
+
+        int node_index = 0;
+        for (const auto& node : nodes) {
+            bool any = false;
+            for (int cpu : parseCpuList(node.second)) {
+                if (!is_allowed(cpu)) continue;
+                topology.cpus.push_back(cpu);
+                topology.cpu_nodes.push_back(node_index);
+                any = true;
+            }
+            if (any) ++node_index;
+        }
+        if (topology.cpus.empty()) {
+            topology.cpus = allowed;
+            topology.cpu_nodes.assign(allowed.size(), 0);
+            node_index = 1;
+        }
+        topology.num_nodes = std::max(1, node_index);
+        return topology;
+    }
+
+    // Parses the sysfs "0-3,8,10-11" format.
+    static std::vector<int> parseCpuList(const std::string& list) {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            if (range.empty()) continue;
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+private:
+    static std::vector<int> allowedCpus() {
+        std::vector<int> cpus;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+            }
+        }
+#endif
+        if (cpus.empty()) {
+            for (unsigned cpu = 0; cpu < std::max(1U, std::thread::hardware_concurrency()); ++cpu) {
+                cpus.push_back(static_cast<int>(cpu));
+            }
+        }
+        return cpus;
+    }
+};
+
+// Binds the calling thread to one CPU. Memory the thread touches first is then
+// placed on that CPU's NUMA node by the kernel's first-touch policy.
+bool pinCurrentThread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+// Per-thread free list of fixed-size I/O buffers. Buffers are allocated and
+// first written by the owning thread, so on a pinned thread they stay
+// NUMA-local and are recycled instead of bouncing through the global heap.
+class BufferPool {
+public:
+    static constexpr size_t kBufferSize = 64 * 1024;
+    static constexpr size_t kMaxFree = 64;
+
+    class Lease {
+    public:
+        Lease(BufferPool* pool, std::unique_ptr<char[]> buffer) : pool_(pool), buffer_(std::move(buffer)) {}
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        Lease(Lease&& other) noexcept : pool_(other.pool_), buffer_(std::move(other.buffer_)) {}
+        Lease& operator=(Lease&&) = delete;
+
+        ~Lease() {
+            if (buffer_) pool_->release(std::move(buffer_));
+        }
+
+        char* data() const { return buffer_.get(); }
+        size_t size() const { return kBufferSize; }
+
+    private:
+        BufferPool* pool_;
+        std::unique_ptr<char[]> buffer_;
+    };
+
+    static BufferPool& local() {
+        thread_local BufferPool pool;
+        return pool;
+    }
+
+    Lease acquire() {
+        if (free_.empty()) {
+            std::unique_ptr<char[]> buffer(new char[kBufferSize]);
+            std::fill_n(buffer.get(), kBufferSize, '\0');  // first touch on this thread
+            return Lease(this, std::move(buffer));
+        }
+        std::unique_ptr<char[]> buffer = std::move(free_.back());
+        free_.pop_back();
+        return Lease(this, std::move(buffer));
+    }
+
+private:
+    void release(std::unique_ptr<char[]> buffer) {
+        if (free_.size() < kMaxFree) free_.push_back(std::move(buffer));
+    }
+
+    std::vector<std::unique_ptr<char[]>> free_;
 };
 
+// Global cap on output files open at once, so in-flight transfers cannot
+// exhaust RLIMIT_NOFILE (sockets need descriptors too).
+class FdBudget {
+public:
+    static FdBudget& getInstance() {
+        static FdBudget instance;
+        return instance;
+    }
+
+    FdBudget(FdBudget const&) = delete;
+    void operator=(FdBudget const&) = delete;
+
+    // 0 picks half of the soft RLIMIT_NOFILE, leaving the rest for sockets.
+    void setCapacity(size_t capacity) {
+        if (capacity == 0) {
+            capacity = 512;
+#ifdef __linux__
+            rlimit limit{};
+            if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+                capacity = std::max<size_t>(16, static_cast<size_t>(limit.rlim_cur) / 2);
+            }
+#endif
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        available_ += static_cast<long>(capacity) - static_cast<long>(capacity_);
+        capacity_ = capacity;
+        condition_.notify_all();
+    }
+
+    void acquire() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        condition_.wait(lock, [this] { return available_ > 0; });
+        --available_;
+    }
+
+    bool tryAcquire() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (available_ <= 0) return false;
+        --available_;
+        return true;
+    }
+
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            ++available_;
+            for (auto& [owner, wake] : waiters_) wake();
+            waiters_.clear();
+        }
+        condition_.notify_one();
+    }
+
+    // For callers that must not block: runs wake once, at the next release()
+    // or right away if a descriptor is already free. One registration per
+    // owner; wake runs with the budget's lock held, so it must be cheap and
+    // must not call back in. forget() drops owner's registration.
+    void notifyOnRelease(const void* owner, std::function<void()> wake) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (available_ > 0) {
+            wake();
+            return;
+        }
+        for (const auto& waiter : waiters_) {
+            if (waiter.first == owner) return;
+        }
+        waiters_.emplace_back(owner, std::move(wake));
+    }
+
+    void forget(const void* owner) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::erase_if(waiters_, [owner](const auto& waiter) { return waiter.first == owner; });
+    }
+
+private:
+    FdBudget() { setCapacity(0); }
+
+    std::mutex mtx_;
+    std::condition_variable condition_;
+    size_t capacity_ = 0;
+    long available_ = 0;
+    std::vector<std::pair<const void*, std::function<void()>>> waiters_;
+};
+
+// Output file created lazily on the first body byte, so transfers waiting on
+// DNS/connect hold no descriptor. Whole-file output goes to "<path>.part" and
+// is renamed into place by commit(); anything not committed is removed, so a
+// failed transfer never leaves a truncated file behind. With an offset the
+// file is an existing pre-sized file written in place (ranged segments).
+class OutputFile {
+public:
+    enum class OpenStatus { Opened, WouldBlock, Failed };
+
+    // A whole-file output is written to path + temp_suffix and renamed on commit.
+    explicit OutputFile(std::string path, curl_off_t offset = -1, const char* temp_suffix = ".part")
+        : path_(std::move(path)), temp_path_(offset >= 0 ? path_ : path_ + temp_suffix), offset_(offset) {}
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    ~OutputFile() {
+        if (!committed_) discard();
+    }
+
+    bool isOpen() const { return static_cast<bool>(file_); }
+    FILE* get() const { return file_.get(); }
+    const std::string& path() const { return path_; }
+
+    // may_block=false returns WouldBlock instead of waiting for the FdBudget.
+    OpenStatus open(bool may_block) {
+        if (file_) return OpenStatus::Opened;
+        if (!has_token_) {
+            if (may_block) {
+                FdBudget::getInstance().acquire();
+            } else if (!FdBudget::getInstance().tryAcquire()) {
+                return OpenStatus::WouldBlock;
+            }
+            has_token_ = true;
+        }
+        file_ = FileHandle(fopen(temp_path_.c_str(), offset_ >= 0 ? "r+b" : "wb"));
+        if (!file_ || (offset_ >= 0 && fseeko(file_.get(), offset_, SEEK_SET) != 0)) {
+            Logger::getInstance().logError("Error opening file: " + temp_path_);
+            close();
+            return OpenStatus::Failed;
+        }
+        created_ = true;
+        write_buffer_.emplace(BufferPool::local().acquire());
+        setvbuf(file_.get(), write_buffer_->data(), _IOFBF, write_buffer_->size());
+        return OpenStatus::Opened;
+    }
+
+    // Flushes and publishes the file; an empty body still produces a file.
+    bool commit() {
+        if (!created_ && open(true) != OpenStatus::Opened) return false;
+        bool ok = fflush(file_.get()) == 0;
+        close();
+        if (ok && offset_ < 0) ok = std::rename(temp_path_.c_str(), path_.c_str()) == 0;
+        if (!ok) {
+            Logger::getInstance().logError("Error writing file: " + path_);
+            return false;
+        }
+        committed_ = true;
+        return true;
+    }
+
+    void discard() {
+        close();
+        if (created_ && offset_ < 0) std::remove(temp_path_.c_str());
+        created_ = false;
+    }
+
+private:
+    void close() {
+        file_ = FileHandle();
+        write_buffer_.reset();  // only after fclose has flushed through it
+        if (has_token_) {
+            FdBudget::getInstance().release();
+            has_token_ = false;
+        }
+    }
+
+    std::string path_;
+    std::string temp_path_;
+    curl_off_t offset_;
+    FileHandle file_;
+    std::optional<BufferPool::Lease> write_buffer_;
+    bool has_token_ = false;
+    bool created_ = false;
+    bool committed_ = false;
+};
+
+// Log2-bucketed latency histogram; bucket k counts samples in [2^(k-1), 2^k) us.
+class LatencyHistogram {
+public:
+    static constexpr size_t kBuckets = 32;
+
+    static size_t bucketFor(std::chrono::microseconds latency) {
+        uint64_t us = static_cast<uint64_t>(std::max<int64_t>(0, latency.count()));
+        size_t bucket = 0;
+        while (us > 0 && bucket + 1 < kBuckets) {
+            us >>= 1;
+            ++bucket;
+        }
+        return bucket;
+    }
+
+    void record(std::chrono::microseconds latency) {
+        buckets_[bucketFor(latency)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void add(size_t bucket, uint64_t count) { buckets_[bucket].fetch_add(count, std::memory_order_relaxed); }
+
+    std::array<uint64_t, kBuckets> snapshot() const {
+        std::array<uint64_t, kBuckets> counts{};
+        for (size_t i = 0; i < kBuckets; ++i) counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        return counts;
+    }
+
+    // Upper bound of the bucket holding the given percentile (0-100).
+    static std::chrono::microseconds percentile(const std::array<uint64_t, kBuckets>& counts, double pct) {
+        uint64_t total = 0;
+        for (uint64_t count : counts) total += count;
+        if (total == 0) return std::chrono::microseconds(0);
+        uint64_t rank = static_cast<uint64_t>(std::ceil(total * pct / 100.0));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += counts[i];
+            if (seen >= rank) return std::chrono::microseconds(i == 0 ? 0 : (1LL << i) - 1);
+        }
+        return std::chrono::microseconds((1LL << (kBuckets - 1)) - 1);
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+};
 
 class ThreadPool {
 public:
-    ThreadPool(size_t num_threads) : stop_(false) {
+    using Clock = std::chrono::steady_clock;
+
+    struct WorkerStats {
+        uint64_t tasks_executed = 0;
+        std::chrono::nanoseconds busy{0};
+        std::chrono::nanoseconds idle{0};
+    };
+
+    struct Stats {
+        size_t queue_length = 0;
+        size_t active_workers = 0;
+        uint64_t tasks_enqueued = 0;
+        std::array<uint64_t, LatencyHistogram::kBuckets> queue_wait{};
+        std::vector<WorkerStats> workers;
+
+        std::chrono::microseconds queueWaitPercentile(double pct) const {
+            return LatencyHistogram::percentile(queue_wait, pct);
+        }
+        double utilization() const {
+            std::chrono::nanoseconds busy{0}, total{0};
+            for (const WorkerStats& worker : workers) {
+                busy += worker.busy;
+                total += worker.busy + worker.idle;
+            }
+            return total.count() > 0 ? static_cast<double>(busy.count()) / total.count() : 0.0;
+        }
+    };
+
+    // When cpus is non-empty, worker i is pinned to cpus[i % cpus.size()].
+    ThreadPool(size_t num_threads, const std::vector<int>& cpus = {}) : stop_(false) {
         for (size_t i = 0; i < num_threads; ++i) {
-            workers_.emplace_back([this] {
+            worker_counters_.push_back(std::make_unique<WorkerCounters>());
+        }
+        for (size_t i = 0; i < num_threads; ++i) {
+            int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+            workers_.emplace_back([this, cpu, &counters = *worker_counters_[i]] {
+                if (cpu >= 0 && !pinCurrentThread(cpu)) {
+                    Logger::getInstance().logError("Could not pin worker to CPU " + std::to_string(cpu));
+                }
                 while (true) {
-                    std::function<void()> task;
+                    QueuedTask task;
+                    Clock::time_point idle_start = Clock::now();
+                    counters.idle_since_ns.store(idle_start.time_since_epoch().count(), std::memory_order_relaxed);
                     {
                         std::unique_lock<std::mutex> lock(queue_mutex_);
                         condition_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
 
                         if (stop_ && tasks_.empty()) {
+                            WorkerCounters::add(counters.idle_ns, Clock::now() - idle_start);
                             return;
                         }
                         task = std::move(tasks_.front());
                         tasks_.pop();
+                        ++active_;
+                    }
+                    Clock::time_point busy_start = Clock::now();
+                    counters.idle_since_ns.store(0, std::memory_order_relaxed);
+                    WorkerCounters::add(counters.idle_ns, busy_start - idle_start);
+                    queue_wait_.record(std::chrono::duration_cast<std::chrono::microseconds>(busy_start - task.enqueued));
+
+                    current_enqueued_ = task.enqueued;
+                    task.run();
+
+                    WorkerCounters::add(counters.busy_ns, Clock::now() - busy_start);
+                    counters.tasks.fetch_add(1, std::memory_order_relaxed);
+                    {
+                        std::lock_guard<std::mutex> lock(queue_mutex_);
+                        --active_;
                     }
-                    task();
+                    idle_condition_.notify_all();
                 }
             });
         }
@@ -155,11 +942,47 @@ public:
                 Logger::getInstance().logError("enqueue on stopped ThreadPool");
                 return;
             }
-            tasks_.emplace(std::forward<F>(f));
+            tasks_.push({std::function<void()>(std::forward<F>(f)), Clock::now()});
+            ++tasks_enqueued_;
         }
         condition_.notify_one();
     }
 
+    // When the task running on the calling worker was enqueued, so tasks can
+    // trace their own queue wait without carrying a timestamp.
+    static Clock::time_point currentTaskEnqueued() { return current_enqueued_; }
+
+    // Blocks until the queue is drained and no task is running, or timeout
+    // expires. Returns true when idle.
+    bool waitForIdle(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        return idle_condition_.wait_for(lock, timeout, [this] { return tasks_.empty() && active_ == 0; });
+    }
+
+    // Consistent-enough snapshot for monitoring; safe to call while running.
+    Stats stats() const {
+        Stats stats;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            stats.queue_length = tasks_.size();
+            stats.active_workers = active_;
+            stats.tasks_enqueued = tasks_enqueued_;
+        }
+        stats.queue_wait = queue_wait_.snapshot();
+        for (const auto& counters : worker_counters_) {
+            WorkerStats worker;
+            worker.tasks_executed = counters->tasks.load(std::memory_order_relaxed);
+            worker.busy = std::chrono::nanoseconds(counters->busy_ns.load(std::memory_order_relaxed));
+            worker.idle = std::chrono::nanoseconds(counters->idle_ns.load(std::memory_order_relaxed));
+            int64_t idle_since = counters->idle_since_ns.load(std::memory_order_relaxed);
+            if (idle_since != 0) {
+                worker.idle += Clock::now() - Clock::time_point(Clock::duration(idle_since));
+            }
+            stats.workers.push_back(worker);
+        }
+        return stats;
+    }
+
     ~ThreadPool() {
         {
             std::unique_lock<std::mutex> lock(queue_mutex_);
@@ -174,121 +997,4700 @@ public:
     }
 
 private:
+    struct QueuedTask {
+        std::function<void()> run;
+        Clock::time_point enqueued;
+    };
+
+    // Written only by the owning worker; read concurrently by stats().
+    struct WorkerCounters {
+        std::atomic<uint64_t> tasks{0};
+        std::atomic<int64_t> busy_ns{0};
+        std::atomic<int64_t> idle_ns{0};
+        std::atomic<int64_t> idle_since_ns{0};  // start of the current wait, 0 while busy
+
+        static void add(std::atomic<int64_t>& counter, Clock::duration elapsed) {
+            counter.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                              std::memory_order_relaxed);
+        }
+    };
+
+    static inline thread_local Clock::time_point current_enqueued_;
+
     std::vector<std::thread> workers_;
-    std::queue<std::function<void()>> tasks_;
+    std::vector<std::unique_ptr<WorkerCounters>> worker_counters_;
+    std::queue<QueuedTask> tasks_;
+    LatencyHistogram queue_wait_;
+    size_t active_ = 0;
+    uint64_t tasks_enqueued_ = 0;
 
-    std::mutex queue_mutex_;
+    mutable std::mutex queue_mutex_;
     std::condition_variable condition_;
+    std::condition_variable idle_condition_;
     bool stop_;
 };
 
 std::atomic<int> g_completed_downloads(0);
-size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream) {
-    size_t written = fwrite(ptr, size, nmemb, stream);
-    return written;
+
+std::string toLower(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+    return text;
 }
 
-void downloadPage(const std::string& url, const std::string& filename, size_t total_urls) {
-    Logger& logger = Logger::getInstance();
-    const int MAX_RETRIES = 3;
-    int retries = 0;
-    CURLcode res;
+std::string_view trim(std::string_view text) {
+    size_t first = text.find_first_not_of(" \t\n\r\f\v");
+    if (first == std::string_view::npos) return {};
+    size_t last = text.find_last_not_of(" \t\n\r\f\v");
+    return text.substr(first, last - first + 1);
+}
 
-    do {
-        CurlHandle curl_handle(curl_easy_init());
-        if (!curl_handle) {
-            logger.logError("Error initializing CURL for " + url);
-            return;
-        }
+std::string hostOf(std::string_view url) {
+    size_t start = url.find("://");
+    start = start == std::string_view::npos ? 0 : start + 3;
+    size_t end = url.find_first_of(":/?#", start);
+    return toLower(std::string(url.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start)));
+}
 
-        FileHandle file_handle(fopen(filename.c_str(), "w")); 
-        if (!file_handle) {
-            logger.logError("Error opening file: " + filename);
-            return;
-        }
+using HostId = uint32_t;
 
-        curl_easy_setopt(curl_handle.get(), CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl_handle.get(), CURLOPT_WRITEFUNCTION, write_data);
-        curl_easy_setopt(curl_handle.get(), CURLOPT_WRITEDATA, file_handle.get());
-        curl_easy_setopt(curl_handle.get(), CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(curl_handle.get(), CURLOPT_TIMEOUT, 30L);      
-        curl_easy_setopt(curl_handle.get(), CURLOPT_LOW_SPEED_LIMIT, 10L); 
-        curl_easy_setopt(curl_handle.get(), CURLOPT_LOW_SPEED_TIME, 5L);  
-        curl_easy_setopt(curl_handle.get(), CURLOPT_FAILONERROR, 1L); 
-        res = curl_easy_perform(curl_handle.get());
+// Dense ids for host names, so per-host state can live in vectors indexed by
+// id instead of string-keyed maps. Input URLs are tagged with their host's id
+// as they are loaded and carry it through to their transfers; only a URL the
+// redirect cache rewrote is interned again. Id 0 is the empty host. Names are
+// never removed, so returned references stay valid.
+class HostTable {
+public:
+    static constexpr HostId kNoHost = 0;
 
-        if (res == CURLE_OK) break;
+    static HostTable& getInstance() {
+        static HostTable instance;
+        return instance;
+    }
 
-        retries++;
-        if (retries < MAX_RETRIES) {
-            logger.log("Retrying " + url + " (" + std::to_string(retries) + "/" + std::to_string(MAX_RETRIES) + ")");
-            std::this_thread::sleep_for(std::chrono::milliseconds(100 * retries));
-        }
-    } while (retries < MAX_RETRIES);
+    HostTable(HostTable const&) = delete;
+    void operator=(HostTable const&) = delete;
 
-    if (res != CURLE_OK) {
-        logger.logError("Download failed for " + url + ": " + curl_easy_strerror(res));
-    } else {
-        int current_completed = ++g_completed_downloads;
-        double percentage = (static_cast<double>(current_completed) / total_urls) * 100;
-        std::string msg = "Downloaded " + std::to_string(current_completed) + "/" + std::to_string(total_urls) +
-                          " (" + std::to_string(percentage) + "%): " + url;
-        logger.log(msg);
+    // host must already be lower case (see hostOf()).
+    HostId intern(std::string_view host) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = ids_.find(host);
+        if (it != ids_.end()) return it->second;
+        const std::string& name = names_.emplace_back(host);
+        return ids_.emplace(name, static_cast<HostId>(names_.size() - 1)).first->second;
     }
-}
-std::vector<std::string> loadURLs(const std::string& filename) {
-    Logger& logger = Logger::getInstance();
-    std::vector<std::string> urls;
-    std::ifstream file(filename);
-    if (!file) {
-        logger.logError("Error opening file: " + filename);
-        return urls;
+
+    const std::string& name(HostId id) const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return names_[id];
+    }
+
+private:
+    HostTable() { intern(""); }
+
+    mutable std::mutex mtx_;
+    std::deque<std::string> names_;  // stable addresses back the ids_ keys
+    std::unordered_map<std::string_view, HostId> ids_;
+};
+
+HostId hostIdOf(std::string_view url) {
+    return HostTable::getInstance().intern(hostOf(url));
+}
+
+// Splits "scheme://host[:port]/path?query" into its origin and the rest.
+std::pair<std::string, std::string> splitOrigin(const std::string& url) {
+    size_t scheme_end = url.find("://");
+    size_t authority_end = url.find_first_of("/?#", scheme_end == std::string::npos ? 0 : scheme_end + 3);
+    if (authority_end == std::string::npos) return {url, ""};
+    return {url.substr(0, authority_end), url.substr(authority_end)};
+}
+
+// Persistent map of permanent (301/308) redirects, consulted before dispatch
+// so known chains cost no extra round trips. Besides exact URL entries it
+// keeps origin-level rules (e.g. http://example.com -> https://www.example.com),
+// which then apply to every URL on that origin. A path-preserving redirect
+// that only upgrades the scheme or adds/drops "www." becomes a rule at once;
+// any other origin move only after kOriginEvidence distinct paths agree, so
+// a path-specific CDN or maintenance redirect stays a per-URL entry.
+class RedirectCache {
+public:
+    static RedirectCache& getInstance() {
+        static RedirectCache instance;
+        return instance;
+    }
+
+    RedirectCache(RedirectCache const&) = delete;
+    void operator=(RedirectCache const&) = delete;
+
+    // File format: one "url|origin <TAB> source <TAB> target <TAB> expiry" per line.
+    void load(const std::string& filename, std::chrono::seconds ttl) {
+        std::unique_lock<std::shared_mutex> lock(mtx_);
+        enabled_ = true;
+        ttl_ = ttl;
+        std::ifstream in(filename);
+        std::string line;
+        const int64_t now = nowSeconds();
+        while (std::getline(in, line)) {
+            std::stringstream fields(line);
+            std::string kind, source, target, expiry;
+            if (!std::getline(fields, kind, '\t') || !std::getline(fields, source, '\t') ||
+                !std::getline(fields, target, '\t') || !std::getline(fields, expiry)) {
+                continue;
+            }
+            Entry entry{target, std::atoll(expiry.c_str())};
+            if (entry.expires <= now) continue;
+            (kind == "origin" ? origins_ : urls_)[source] = entry;
+            if (kind == "url") {
+                // Cached URL entries count as evidence towards an origin rule.
+                const std::optional<OriginMove> move = originMove(source, target);
+                if (move && addEvidence(*move) && !origins_.count(move->source_origin)) {
+                    origins_[move->source_origin] = {move->target_origin, entry.expires};
+                }
+            }
+        }
+    }
+
+    bool save(const std::string& filename) const {
+        std::shared_lock<std::shared_mutex> lock(mtx_);
+        if (!enabled_) return true;
+        const std::string tmp = filename + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            const int64_t now = nowSeconds();
+            for (const auto& [source, entry] : origins_) {
+                if (entry.expires > now) out << "origin\t" << source << '\t' << entry.target << '\t' << entry.expires << '\n';
+            }
+            for (const auto& [source, entry] : urls_) {
+                if (entry.expires > now) out << "url\t" << source << '\t' << entry.target << '\t' << entry.expires << '\n';
+            }
+            if (!out) return false;
+        }
+        return std::rename(tmp.c_str(), filename.c_str()) == 0;
+    }
+
+    // Returns the cached final location for url, or url itself.
+    std::string resolve(const std::string& url) const {
+        std::shared_lock<std::shared_mutex> lock(mtx_);
+        if (!enabled_) return url;
+        const int64_t now = nowSeconds();
+        auto exact = urls_.find(url);
+        if (exact != urls_.end() && exact->second.expires > now) {
+            ++rewritten_;
+            return exact->second.target;
+        }
+        auto [origin, rest] = splitOrigin(url);
+        auto rule = origins_.find(origin);
+        if (rule != origins_.end() && rule->second.expires > now) {
+            ++rewritten_;
+            return rule->second.target + rest;
+        }
+        return url;
+    }
+
+    // URLs resolve() has rewritten so far.
+    size_t rewritten() const { return rewritten_; }
+
+    void record(const std::string& source, const std::string& target) {
+        if (source == target) return;
+        std::unique_lock<std::shared_mutex> lock(mtx_);
+        if (!enabled_) return;
+        const int64_t expires = nowSeconds() + ttl_.count();
+        const std::optional<OriginMove> move = originMove(source, target);
+        if (move && isOriginAlias(move->source_origin, move->target_origin)) {
+            origins_[move->source_origin] = {move->target_origin, expires};
+            return;
+        }
+        urls_[source] = {target, expires};
+        if (move && addEvidence(*move)) origins_[move->source_origin] = {move->target_origin, expires};
+    }
+
+private:
+    struct Entry {
+        std::string target;
+        int64_t expires = 0;  // seconds since the Unix epoch
+    };
+
+    // Distinct paths that must show the same cross-origin move before it is
+    // trusted for the whole origin.
+    static constexpr size_t kOriginEvidence = 3;
+
+    struct Candidate {
+        std::string target;
+        std::unordered_set<std::string> paths;
+    };
+
+    // A redirect to another origin that keeps the path and query.
+    struct OriginMove {
+        std::string source_origin;
+        std::string target_origin;
+        std::string path;  // never empty: "" is stored as "/", the same resource
+    };
+
+    RedirectCache() = default;
+
+    // The origin move source -> target makes, if it is one. Used by both
+    // record() and load(), so evidence keys match across runs.
+    static std::optional<OriginMove> originMove(const std::string& source, const std::string& target) {
+        auto [source_origin, source_path] = splitOrigin(source);
+        auto [target_origin, target_path] = splitOrigin(target);
+        if (source_path.empty()) source_path = "/";
+        if (target_path.empty()) target_path = "/";
+        if (source_origin == target_origin || source_path != target_path) return std::nullopt;
+        return OriginMove{std::move(source_origin), std::move(target_origin), std::move(source_path)};
+    }
+
+    // Records one path's move; true once kOriginEvidence distinct paths of
+    // the source origin agree on the target.
+    bool addEvidence(const OriginMove& move) {
+        Candidate& candidate = candidates_[move.source_origin];
+        if (candidate.target != move.target_origin) candidate = {move.target_origin, {}};
+        candidate.paths.insert(move.path);
+        return candidate.paths.size() >= kOriginEvidence;
+    }
+
+    // True when the origins differ only by an http -> https upgrade and/or a
+    // "www." prefix on the host.
+    static bool isOriginAlias(const std::string& source, const std::string& target) {
+        auto split = [](const std::string& origin) {
+            size_t scheme_end = origin.find("://");
+            if (scheme_end == std::string::npos) return std::pair<std::string, std::string>{"", toLower(origin)};
+            return std::pair<std::string, std::string>{toLower(origin.substr(0, scheme_end)),
+                                                       toLower(origin.substr(scheme_end + 3))};
+        };
+        auto [source_scheme, source_host] = split(source);
+        auto [target_scheme, target_host] = split(target);
+        if (source_scheme != target_scheme && !(source_scheme == "http" && target_scheme == "https")) return false;
+        if (source_scheme != target_scheme && source_host.size() > 3 && source_host.ends_with(":80")) {
+            source_host.resize(source_host.size() - 3);
+        }
+        return source_host == target_host || target_host == "www." + source_host || source_host == "www." + target_host;
+    }
+
+    static int64_t nowSeconds() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    mutable std::shared_mutex mtx_;
+    bool enabled_ = false;
+    std::chrono::seconds ttl_{0};
+    std::unordered_map<std::string, Entry> urls_;
+    std::unordered_map<std::string, Entry> origins_;
+    std::unordered_map<std::string, Candidate> candidates_;  // by source origin, rebuilt from urls_ on load
+    mutable std::atomic<size_t> rewritten_{0};
+};
+
+// "YYYYMMDD HH:MM:SS" in UTC, the expiry format of libcurl's HSTS and
+// Alt-Svc files.
+std::string formatExpire(std::time_t time) {
+    std::tm utc{};
+    gmtime_r(&time, &utc);
+    char buf[18];
+    std::strftime(buf, sizeof(buf), "%Y%m%d %H:%M:%S", &utc);
+    return buf;
+}
+
+// Process-wide HSTS knowledge shared by every easy handle through libcurl's
+// HSTS read/write callbacks, and persisted in libcurl's own HSTS file format
+// so it also interoperates with `curl --hsts`. Each transfer is only fed the
+// entries that can apply to its host instead of the whole cache.
+class HstsStore {
+public:
+    struct Entry {
+        std::string host;
+        bool include_subdomains = false;
+        std::string expire;  // "YYYYMMDD HH:MM:SS" UTC, compares lexicographically
+    };
+
+    static HstsStore& getInstance() {
+        static HstsStore instance;
+        return instance;
+    }
+
+    HstsStore(HstsStore const&) = delete;
+    void operator=(HstsStore const&) = delete;
+
+    // Lines look like: [.]host "YYYYMMDD HH:MM:SS"; a leading dot means includeSubDomains.
+    void load(const std::string& filename) {
+        std::ifstream in(filename);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            size_t quote = line.find('"');
+            if (quote == std::string::npos || quote == 0) continue;
+            std::string host(trim(std::string_view(line).substr(0, quote)));
+            std::string expire = line.substr(quote + 1, line.find('"', quote + 1) - quote - 1);
+            bool include_subdomains = !host.empty() && host[0] == '.';
+            if (include_subdomains) host.erase(0, 1);
+            record(host, include_subdomains, expire);
+        }
+    }
+
+    bool save(const std::string& filename) const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        const std::string tmp = filename + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << "# HSTS cache written by multi_downloader\n";
+            const std::string now = nowExpire();
+            for (const auto& [host, entry] : entries_) {
+                if (entry.expire <= now) continue;
+                out << (entry.include_subdomains ? "." : "") << host << " \"" << entry.expire << "\"\n";
+            }
+            if (!out) return false;
+        }
+        return std::rename(tmp.c_str(), filename.c_str()) == 0;
+    }
+
+    void record(const std::string& host, bool include_subdomains, const std::string& expire) {
+        if (host.empty()) return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        Entry& entry = entries_[toLower(host)];
+        if (entry.host.empty() || expire > entry.expire) {
+            entry = {toLower(host), include_subdomains, expire};
+        }
+    }
+
+    // The host's own entry plus parent-domain entries with includeSubDomains.
+    std::vector<Entry> entriesFor(const std::string& host) const {
+        std::vector<Entry> matches;
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (entries_.empty()) return matches;
+        const std::string now = nowExpire();
+        std::string candidate = host;
+        while (true) {
+            auto it = entries_.find(candidate);
+            if (it != entries_.end() && it->second.expire > now &&
+                (candidate == host || it->second.include_subdomains)) {
+                matches.push_back(it->second);
+            }
+            size_t dot = candidate.find('.');
+            if (dot == std::string::npos) break;
+            candidate.erase(0, dot + 1);
+        }
+        return matches;
+    }
+
+private:
+    HstsStore() = default;
+
+    static std::string nowExpire() { return formatExpire(std::time(nullptr)); }
+
+    mutable std::mutex mtx_;
+    std::unordered_map<std::string, Entry> entries_;
+};
+
+// "host:port" of an https URL (the only scheme Alt-Svc applies to), or "".
+std::string altSvcOrigin(std::string_view url) {
+    if (url.rfind("https://", 0) != 0) return {};
+    const std::string host = hostOf(url);
+    std::string_view authority = url.substr(8, url.find_first_of("/?#", 8) - 8);
+    size_t colon = authority.rfind(':');
+    std::string port = colon == std::string_view::npos ? "443" : std::string(authority.substr(colon + 1));
+    return host + ":" + port;
+}
+
+// Process-wide Alt-Svc cache. libcurl keeps Alt-Svc state per easy handle and
+// shares it only through a file every handle reads on setup and rewrites on
+// cleanup, so instead the Alt-Svc headers of finished transfers are recorded
+// here and later transfers are pointed at the alternative with
+// CURLOPT_CONNECT_TO. Loaded once and saved once, in libcurl's alt-svc file
+// format so it also interoperates with `curl --alt-svc`.
+class AltSvcStore {
+public:
+    struct Entry {
+        std::string alpn;  // "h2" or "h3"
+        std::string host;
+        int port = 0;
+        std::string expire;  // "YYYYMMDD HH:MM:SS" UTC
+    };
+
+    static AltSvcStore& getInstance() {
+        static AltSvcStore instance;
+        return instance;
+    }
+
+    AltSvcStore(AltSvcStore const&) = delete;
+    void operator=(AltSvcStore const&) = delete;
+
+    // Lines look like: src_alpn src_host src_port dst_alpn dst_host dst_port "YYYYMMDD HH:MM:SS" persist prio
+    void load(const std::string& filename) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        enabled_ = true;
+        std::ifstream in(filename);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            std::stringstream fields(line);
+            std::string src_alpn, src_host, src_port;
+            Entry entry;
+            size_t quote = line.find('"');
+            if (!(fields >> src_alpn >> src_host >> src_port >> entry.alpn >> entry.host >> entry.port) ||
+                quote == std::string::npos) {
+                continue;
+            }
+            entry.expire = line.substr(quote + 1, line.find('"', quote + 1) - quote - 1);
+            addLocked(toLower(src_host) + ":" + src_port, entry);
+        }
+    }
+
+    bool save(const std::string& filename) const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!enabled_) return true;
+        const std::string tmp = filename + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << "# Alt-Svc cache written by multi_downloader\n";
+            const std::string now = formatExpire(std::time(nullptr));
+            for (const auto& [origin, entries] : origins_) {
+                const size_t colon = origin.rfind(':');
+                for (const Entry& entry : entries) {
+                    if (entry.expire <= now) continue;
+                    out << "h1 " << origin.substr(0, colon) << ' ' << origin.substr(colon + 1) << ' ' << entry.alpn << ' '
+                        << entry.host << ' ' << entry.port << " \"" << entry.expire << "\" 0 0\n";
+                }
+            }
+            if (!out) return false;
+        }
+        return std::rename(tmp.c_str(), filename.c_str()) == 0;
+    }
+
+    bool enabled() const { return enabled_; }
+
+    // Applies an Alt-Svc header value received from origin ("host:port"):
+    // alternatives such as h3=":443"; ma=86400, or "clear".
+    void record(const std::string& origin, std::string_view header) {
+        if (!enabled_ || origin.empty()) return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (trim(header) == "clear") {
+            origins_.erase(origin);
+            return;
+        }
+        const std::string origin_host = origin.substr(0, origin.rfind(':'));
+        std::vector<Entry> fresh;
+        std::stringstream alternatives{std::string(header)};
+        std::string alternative;
+        while (std::getline(alternatives, alternative, ',')) {
+            std::stringstream params(alternative);
+            std::string param;
+            Entry entry;
+            long max_age = 86400;
+            while (std::getline(params, param, ';')) {
+                std::string_view text = trim(param);
+                size_t equals = text.find('=');
+                if (equals == std::string_view::npos) continue;
+                std::string_view key = trim(text.substr(0, equals)), value = trim(text.substr(equals + 1));
+                if (value.size() >= 2 && value.front() == '"') value = value.substr(1, value.size() - 2);
+                if (entry.alpn.empty()) {
+                    size_t colon = value.rfind(':');
+                    if (colon == std::string_view::npos) break;
+                    entry.alpn = std::string(key);
+                    entry.host = colon == 0 ? origin_host : toLower(std::string(value.substr(0, colon)));
+                    entry.port = std::atoi(std::string(value.substr(colon + 1)).c_str());
+                } else if (key == "ma") {
+                    max_age = std::atol(std::string(value).c_str());
+                }
+            }
+            if ((entry.alpn != "h2" && entry.alpn != "h3") || entry.port <= 0 || max_age <= 0) continue;
+            entry.expire = formatExpire(std::time(nullptr) + max_age);
+            fresh.push_back(entry);
+        }
+        if (!fresh.empty()) origins_[origin] = std::move(fresh);
+    }
+
+    // The preferred live alternative for origin: h3 when libcurl can speak it.
+    std::optional<Entry> alternativeFor(const std::string& origin, bool http3) const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = origins_.find(origin);
+        if (it == origins_.end()) return std::nullopt;
+        const std::string now = formatExpire(std::time(nullptr));
+        std::optional<Entry> best;
+        for (const Entry& entry : it->second) {
+            if (entry.expire <= now || (entry.alpn == "h3" && !http3)) continue;
+            if (!best || (entry.alpn == "h3" && best->alpn != "h3")) best = entry;
+        }
+        return best;
+    }
+
+private:
+    AltSvcStore() = default;
+
+    void addLocked(const std::string& origin, const Entry& entry) {
+        if (entry.alpn == "h2" || entry.alpn == "h3") origins_[origin].push_back(entry);
+    }
+
+    mutable std::mutex mtx_;
+    std::atomic<bool> enabled_{false};
+    std::unordered_map<std::string, std::vector<Entry>> origins_;  // by origin "host:port"
+};
+
+// Byte-rate token bucket. A taker may overdraw by one chunk, which keeps
+// large libcurl write chunks from stalling forever on a small burst size.
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket(double bytes_per_sec, double burst_bytes)
+        : rate_(bytes_per_sec), burst_(burst_bytes), tokens_(burst_bytes), last_(Clock::now()) {}
+
+    // Caller holds the limiter lock.
+    bool ready() {
+        refill();
+        return tokens_ > 0;
+    }
+    void take(size_t bytes) { tokens_ -= static_cast<double>(bytes); }
+    std::chrono::nanoseconds untilReady() const {
+        if (tokens_ > 0) return std::chrono::nanoseconds(0);
+        return std::chrono::nanoseconds(static_cast<int64_t>((1.0 - tokens_) / rate_ * 1e9));
+    }
+
+private:
+    void refill() {
+        Clock::time_point now = Clock::now();
+        tokens_ = std::min(burst_, tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+        last_ = now;
+    }
+
+    double rate_;
+    double burst_;
+    double tokens_;
+    Clock::time_point last_;
+};
+
+// Global and per-host receive-rate caps applied in the write callback. The
+// buckets are shared, so budget left unused by idle or slow transfers flows
+// to whichever active transfers can use it; per-transfer fixed caps
+// (CURLOPT_MAX_RECV_SPEED_LARGE) cannot redistribute like that.
+class BandwidthLimiter {
+public:
+    static BandwidthLimiter& getInstance() {
+        static BandwidthLimiter instance;
+        return instance;
+    }
+
+    BandwidthLimiter(BandwidthLimiter const&) = delete;
+    void operator=(BandwidthLimiter const&) = delete;
+
+    // Rates in bytes per second; 0 means unlimited. Burst is a quarter second.
+    void configure(curl_off_t global_rate, curl_off_t per_host_rate) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        global_.reset();
+        if (global_rate > 0) global_.emplace(static_cast<double>(global_rate), global_rate / 4.0);
+        per_host_rate_ = per_host_rate;
+        hosts_.clear();
+        enabled_ = global_rate > 0 || per_host_rate > 0;
+    }
+
+    bool enabled() const { return enabled_; }
+
+    // Non-blocking: takes the bytes and returns true when both buckets allow.
+    bool tryAcquire(HostId host, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return tryAcquireLocked(host, bytes, nullptr);
+    }
+
+    // Blocks the calling thread until the bytes may be received.
+    void acquire(HostId host, size_t bytes) {
+        while (true) {
+            std::chrono::nanoseconds wait{0};
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                if (tryAcquireLocked(host, bytes, &wait)) return;
+            }
+            std::this_thread::sleep_for(std::clamp(wait, std::chrono::nanoseconds(std::chrono::milliseconds(1)),
+                                                   std::chrono::nanoseconds(std::chrono::milliseconds(100))));
+        }
+    }
+
+private:
+    BandwidthLimiter() = default;
+
+    bool tryAcquireLocked(HostId host, size_t bytes, std::chrono::nanoseconds* wait) {
+        TokenBucket* host_bucket = nullptr;
+        if (per_host_rate_ > 0) {
+            if (host >= hosts_.size()) hosts_.resize(host + 1);
+            if (!hosts_[host]) hosts_[host].emplace(static_cast<double>(per_host_rate_), per_host_rate_ / 4.0);
+            host_bucket = &*hosts_[host];
+        }
+        bool global_ready = !global_ || global_->ready();
+        bool host_ready = !host_bucket || host_bucket->ready();
+        if (!global_ready || !host_ready) {
+            if (wait) {
+                *wait = std::max(global_ ? global_->untilReady() : std::chrono::nanoseconds(0),
+                                 host_bucket ? host_bucket->untilReady() : std::chrono::nanoseconds(0));
+            }
+            return false;
+        }
+        if (global_) global_->take(bytes);
+        if (host_bucket) host_bucket->take(bytes);
+        return true;
+    }
+
+    std::mutex mtx_;
+    std::atomic<bool> enabled_{false};
+    std::optional<TokenBucket> global_;
+    curl_off_t per_host_rate_ = 0;
+    std::vector<std::optional<TokenBucket>> hosts_;  // by HostId
+};
+
+// Pool of egress proxies (any scheme libcurl accepts in CURLOPT_PROXY: http,
+// https, socks4, socks5, socks5h). Every transfer attempt leases one proxy,
+// picked at random in proportion to weight / latency, discounted by its
+// recent error rate, among the proxies below their concurrency limit. A
+// retry avoids the proxy of the failed attempt whenever another is free.
+// Latency (time to first byte) and error rate are exponentially weighted
+// moving averages over completed attempts.
+class ProxyPool {
+public:
+    struct Proxy {
+        std::string url;
+        size_t max_concurrency = 0;  // 0 = unlimited
+        double weight = 1.0;
+    };
+
+    static ProxyPool& getInstance() {
+        static ProxyPool instance;
+        return instance;
+    }
+
+    ProxyPool(ProxyPool const&) = delete;
+    void operator=(ProxyPool const&) = delete;
+
+    // Call once, before any transfer starts.
+    void configure(const std::vector<Proxy>& proxies) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        states_.clear();
+        for (const Proxy& proxy : proxies) states_.push_back({proxy});
+    }
+
+    bool enabled() const { return !states_.empty(); }
+
+    // Index of the leased proxy, or -1 if every proxy is at its limit.
+    int tryAcquire(int avoid = -1) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return pickLocked(avoid);
+    }
+
+    // Blocks until a proxy is free.
+    int acquire(int avoid = -1) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        int index = -1;
+        freed_.wait(lock, [&] { return (index = pickLocked(avoid)) >= 0; });
+        return index;
+    }
+
+    // proxy_ok is false when the attempt failed in a way that blames the
+    // proxy rather than the origin; ttfb is only used for successful attempts.
+    void release(int index, bool proxy_ok, std::chrono::microseconds ttfb) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            State& state = states_[static_cast<size_t>(index)];
+            --state.in_flight;
+            ++state.requests;
+            if (!proxy_ok) ++state.failures;
+            state.error_rate += kAlpha * ((proxy_ok ? 0.0 : 1.0) - state.error_rate);
+            if (proxy_ok && ttfb.count() > 0) state.latency_ms += kAlpha * (ttfb.count() / 1000.0 - state.latency_ms);
+        }
+        freed_.notify_one();
+    }
+
+    const std::string& url(int index) const { return states_[static_cast<size_t>(index)].config.url; }
+
+    std::vector<std::string> summary() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::vector<std::string> lines;
+        for (const State& state : states_) {
+            std::ostringstream line;
+            line << "Proxy " << state.config.url << ": " << state.requests << " attempts, " << state.failures
+                 << " proxy failures, ttfb ~" << std::fixed << std::setprecision(1) << state.latency_ms
+                 << "ms, error rate " << std::setprecision(2) << state.error_rate;
+            lines.push_back(line.str());
+        }
+        return lines;
+    }
+
+private:
+    ProxyPool() : rng_(std::random_device{}()) {}
+
+    struct State {
+        Proxy config;
+        size_t in_flight = 0;
+        double latency_ms = 100.0;  // prior until the first measurement
+        double error_rate = 0.0;
+        uint64_t requests = 0;
+        uint64_t failures = 0;
+    };
+
+    static constexpr double kAlpha = 0.2;
+
+    int pickLocked(int avoid) {
+        std::vector<double> scores(states_.size(), 0.0);
+        double total = 0.0;
+        for (int pass = 0; pass < 2 && total == 0.0; ++pass) {
+            for (size_t i = 0; i < states_.size(); ++i) {
+                const State& state = states_[i];
+                if (state.config.max_concurrency > 0 && state.in_flight >= state.config.max_concurrency) continue;
+                if (pass == 0 && static_cast<int>(i) == avoid) continue;  // second pass allows it as a last resort
+                // Keep a trickle of traffic on failing proxies so they can recover.
+                const double health = std::max(0.01, (1.0 - state.error_rate) * (1.0 - state.error_rate));
+                scores[i] = state.config.weight * health / std::max(1.0, state.latency_ms);
+                total += scores[i];
+            }
+        }
+        if (total == 0.0) return -1;
+        double target = std::uniform_real_distribution<double>(0.0, total)(rng_);
+        size_t chosen = 0;
+        for (size_t i = 0; i < scores.size(); ++i) {
+            if (scores[i] == 0.0) continue;
+            chosen = i;
+            if ((target -= scores[i]) < 0.0) break;
+        }
+        ++states_[chosen].in_flight;
+        return static_cast<int>(chosen);
+    }
+
+    mutable std::mutex mtx_;
+    std::condition_variable freed_;
+    std::vector<State> states_;
+    std::mt19937_64 rng_;
+};
+
+// Whether a failed attempt should count against its proxy: nothing came back
+// from the origin, or the proxy itself refused us.
+bool isProxyFailure(CURLcode code, long http_status) {
+    if (code == CURLE_OK) return false;
+    if (http_status == 407) return true;
+    return http_status == 0 && code != CURLE_WRITE_ERROR && code != CURLE_ABORTED_BY_CALLBACK;
+}
+
+std::chrono::microseconds timeToFirstByte(CURL* handle) {
+    curl_off_t ttfb = 0;
+    curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+    return std::chrono::microseconds(ttfb);
+}
+
+// Concurrent transfers per host. The limit is --max-per-host (0 = none),
+// lowered per host by limits the host profiles learned in earlier runs. A
+// rate-limit response halves the host's in-flight count into its limit for
+// the rest of the run. Nothing blocks: event loops queue transfers that did
+// not get a slot, and thread-pool tasks park a continuation that release()
+// hands the freed slot to.
+class HostLimiter {
+public:
+    static HostLimiter& getInstance() {
+        static HostLimiter instance;
+        return instance;
+    }
+
+    HostLimiter(HostLimiter const&) = delete;
+    void operator=(HostLimiter const&) = delete;
+
+    // seeded holds learned limits by HostId; 0 = none.
+    void configure(size_t default_limit, const std::vector<size_t>& seeded) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        default_limit_ = default_limit;
+        for (HostId host = 0; host < seeded.size(); ++host) {
+            if (seeded[host] > 0) stateFor(host).limit = limitWithDefault(seeded[host]);
+        }
+    }
+
+    bool tryAcquire(HostId host) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return tryAcquireLocked(host);
+    }
+
+    // Takes a slot and returns true, or parks resume and returns false;
+    // resume is later called by release(), already holding the slot.
+    bool acquireOrPark(HostId host, std::function<void()> resume) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (tryAcquireLocked(host)) return true;
+        stateFor(host).parked.push_back(std::move(resume));
+        return false;
+    }
+
+    // Called by a resumed task before it runs: false when acquire() took
+    // the slot it was handed, and it has to get in line again.
+    bool claimHandOff(HostId host) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        State& state = stateFor(host);
+        if (state.handed_off == 0) return false;
+        --state.handed_off;
+        return true;
+    }
+
+    // Blocks until a slot is free, for a worker retaking the slot it gave up
+    // during a retry backoff. A slot handed to a parked task that has not
+    // started yet is taken over: that task waits for a pool worker, and the
+    // blocked ones may be all there are.
+    void acquire(HostId host) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        condition_.wait(lock, [&] {
+            State& state = stateFor(host);
+            if (state.handed_off == 0) return tryAcquireLocked(host);
+            --state.handed_off;
+            return true;
+        });
+    }
+
+    void release(HostId host) {
+        std::function<void()> resume;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            State& state = stateFor(host);
+            if (!state.parked.empty() && (state.limit == 0 || state.in_flight <= state.limit)) {
+                resume = std::move(state.parked.front());  // the slot passes straight to it
+                state.parked.pop_front();
+                ++state.handed_off;
+            } else {
+                --state.in_flight;
+            }
+        }
+        condition_.notify_all();
+        if (resume) resume();
+    }
+
+    // Call while the rate-limited transfer still holds its slot. A burst of
+    // rejections from one window of requests counts as a single signal.
+    void onRateLimited(HostId host) {
+        const auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mtx_);
+        State& state = stateFor(host);
+        if (state.throttled && now - state.last_cut < kCutInterval) return;
+        const size_t halved = std::max<size_t>(1, state.in_flight / 2);
+        if (state.limit == 0 || halved < state.limit) state.limit = halved;
+        state.throttled = true;
+        state.last_cut = now;
+    }
+
+    // Limits of the hosts that rate limited this run, by HostId (0 = not
+    // throttled), for the host profiles.
+    std::vector<size_t> throttledHosts() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::vector<size_t> throttled(hosts_.size());
+        for (HostId host = 0; host < hosts_.size(); ++host) {
+            if (hosts_[host].throttled) throttled[host] = hosts_[host].limit;
+        }
+        return throttled;
+    }
+
+private:
+    struct State {
+        size_t in_flight = 0;
+        size_t limit = 0;  // 0 = unlimited
+        bool throttled = false;
+        std::chrono::steady_clock::time_point last_cut{};
+        std::deque<std::function<void()>> parked;  // waiting for a slot, oldest first
+        size_t handed_off = 0;  // slots passed to resumed tasks that have not claimed them yet
+    };
+
+    static constexpr std::chrono::seconds kCutInterval{1};
+
+    HostLimiter() = default;
+
+    size_t limitWithDefault(size_t limit) const {
+        if (default_limit_ == 0) return limit;
+        return limit == 0 ? default_limit_ : std::min(limit, default_limit_);
+    }
+
+    State& stateFor(HostId host) {
+        if (host >= hosts_.size()) hosts_.resize(host + 1, State{0, default_limit_, false, {}, {}, 0});
+        return hosts_[host];
+    }
+
+    bool tryAcquireLocked(HostId host) {
+        State& state = stateFor(host);
+        if (state.limit > 0 && state.in_flight >= state.limit) return false;
+        ++state.in_flight;
+        return true;
+    }
+
+    mutable std::mutex mtx_;
+    std::condition_variable condition_;  // a slot was released or handed off
+    size_t default_limit_ = 0;
+    std::vector<State> hosts_;  // by HostId
+};
+
+// Runs task on the calling pool worker while holding a HostLimiter slot for
+// host. When the host is at its limit the task is parked instead, and
+// re-enqueued on pool once a slot frees up, so the worker moves on to other
+// hosts rather than waiting.
+void runWithHostSlot(ThreadPool& pool, HostId host, std::function<void()> task) {
+    HostLimiter& limiter = HostLimiter::getInstance();
+    if (limiter.tryAcquire(host) || limiter.acquireOrPark(host, [&pool, host, task] {
+            pool.enqueue([&pool, host, task] {
+                HostLimiter& limiter = HostLimiter::getInstance();
+                if (!limiter.claimHandOff(host)) {
+                    runWithHostSlot(pool, host, task);  // a retrying worker took the slot back
+                    return;
+                }
+                task();
+                limiter.release(host);
+            });
+        })) {
+        task();
+        limiter.release(host);
+    }
+}
+
+void enqueueWithHostSlot(ThreadPool& pool, HostId host, std::function<void()> task) {
+    pool.enqueue([&pool, host, task = std::move(task)]() mutable { runWithHostSlot(pool, host, std::move(task)); });
+}
+
+// Per-host time-to-first-byte histograms behind --hedge. Once a host has
+// enough samples, a request still waiting for its first byte past the
+// configured percentile gets a duplicate; hedgeDelay() returns 0 until then.
+class TtfbTracker {
+public:
+    static TtfbTracker& getInstance() {
+        static TtfbTracker instance;
+        return instance;
+    }
+
+    TtfbTracker(TtfbTracker const&) = delete;
+    void operator=(TtfbTracker const&) = delete;
+
+    void configure(bool enabled, double percentile, uint64_t min_samples) {
+        enabled_ = enabled;
+        percentile_ = percentile;
+        min_samples_ = min_samples;
+    }
+    bool enabled() const { return enabled_; }
+
+    void record(HostId host, std::chrono::microseconds ttfb) {
+        if (!enabled_ || ttfb.count() <= 0) return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        histogramFor(host).record(ttfb);
+    }
+
+    // Starts a host from a distribution saved by an earlier run.
+    void seed(HostId host, const std::array<uint64_t, LatencyHistogram::kBuckets>& counts) {
+        if (std::all_of(counts.begin(), counts.end(), [](uint64_t count) { return count == 0; })) return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        LatencyHistogram& histogram = histogramFor(host);
+        for (size_t i = 0; i < counts.size(); ++i) {
+            if (counts[i] > 0) histogram.add(i, counts[i]);
+        }
+    }
+
+    std::chrono::microseconds hedgeDelay(HostId host) {
+        if (!enabled_) return std::chrono::microseconds(0);
+        std::array<uint64_t, LatencyHistogram::kBuckets> counts;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (host >= hosts_.size() || !hosts_[host]) return std::chrono::microseconds(0);
+            counts = hosts_[host]->snapshot();
+        }
+        uint64_t samples = 0;
+        for (uint64_t count : counts) samples += count;
+        if (samples < min_samples_) return std::chrono::microseconds(0);
+        return std::max(LatencyHistogram::percentile(counts, percentile_), kMinDelay);
+    }
+
+    void noteHedge(bool won) {
+        issued_++;
+        if (won) won_++;
+    }
+
+    std::string summary() const {
+        return "Hedged requests: " + std::to_string(issued_.load()) + " issued, " + std::to_string(won_.load()) + " won";
+    }
+
+private:
+    static constexpr std::chrono::microseconds kMinDelay{1000};
+
+    TtfbTracker() = default;
+
+    LatencyHistogram& histogramFor(HostId host) {
+        if (host >= hosts_.size()) hosts_.resize(host + 1);
+        if (!hosts_[host]) hosts_[host] = std::make_unique<LatencyHistogram>();
+        return *hosts_[host];
+    }
+
+    bool enabled_ = false;
+    double percentile_ = 95;
+    uint64_t min_samples_ = 20;
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<LatencyHistogram>> hosts_;  // by HostId; null until the first sample
+    std::atomic<uint64_t> issued_{0};
+    std::atomic<uint64_t> won_{0};
+};
+
+// Per-host profile kept across runs: moving averages of time to first byte,
+// total time, body size and throughput, the TTFB distribution, attempt error
+// rate, HTTP version, rate-limit responses and a learned concurrency limit.
+// Loaded at startup to seed scheduling, hedging and HostLimiter; rewritten
+// at exit.
+class HostProfiles {
+public:
+    using Buckets = std::array<uint64_t, LatencyHistogram::kBuckets>;
+
+    static HostProfiles& getInstance() {
+        static HostProfiles instance;
+        return instance;
+    }
+
+    HostProfiles(HostProfiles const&) = delete;
+    void operator=(HostProfiles const&) = delete;
+
+    // File format: one line per host of tab-separated fields: host, transfers,
+    // ttfb_ms, total_ms, bytes, bytes_per_sec, attempts, error_rate,
+    // rate_limited, retry_after_s, concurrency_limit, http_version and the
+    // TTFB histogram as "bucket:count,...".
+    void load(const std::string& filename) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        enabled_ = true;
+        std::ifstream in(filename);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::stringstream fields(line);
+            std::string host, histogram;
+            Profile profile;
+            if (!std::getline(fields, host, '\t') ||
+                !(fields >> profile.transfers >> profile.ttfb_ms >> profile.total_ms >> profile.bytes >> profile.bytes_per_sec >>
+                  profile.attempts >> profile.error_rate >> profile.rate_limited >> profile.retry_after_s >>
+                  profile.concurrency_limit >> profile.http_version)) {
+                continue;
+            }
+            fields >> histogram;
+            std::stringstream entries(histogram);
+            std::string entry;
+            uint64_t samples = 0;
+            while (std::getline(entries, entry, ',')) {
+                size_t bucket = std::strtoull(entry.c_str(), nullptr, 10);
+                size_t colon = entry.find(':');
+                if (colon == std::string::npos || bucket >= profile.ttfb.size()) continue;
+                profile.ttfb[bucket] = std::strtoull(entry.c_str() + colon + 1, nullptr, 10);
+                samples += profile.ttfb[bucket];
+            }
+            // Old samples fade: the distribution keeps at most kMaxSamples.
+            if (samples > kMaxSamples) {
+                for (uint64_t& count : profile.ttfb) count = count * kMaxSamples / samples;
+            }
+            profile.known = true;
+            profileFor(HostTable::getInstance().intern(toLower(host))) = profile;
+        }
+    }
+
+    bool save(const std::string& filename) const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!enabled_) return true;
+        const std::string tmp = filename + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            for (HostId host = 0; host < profiles_.size(); ++host) {
+                const Profile& profile = profiles_[host];
+                if (!profile.known) continue;
+                out << HostTable::getInstance().name(host) << '\t' << profile.transfers << '\t' << profile.ttfb_ms << '\t' << profile.total_ms << '\t'
+                    << profile.bytes << '\t' << profile.bytes_per_sec << '\t' << profile.attempts << '\t'
+                    << profile.error_rate << '\t' << profile.rate_limited << '\t' << profile.retry_after_s << '\t'
+                    << profile.concurrency_limit << '\t' << profile.http_version << '\t';
+                bool first = true;
+                for (size_t i = 0; i < profile.ttfb.size(); ++i) {
+                    if (profile.ttfb[i] == 0) continue;
+                    out << (first ? "" : ",") << i << ':' << profile.ttfb[i];
+                    first = false;
+                }
+                out << (first ? "-" : "") << '\n';
+            }
+            if (!out) return false;
+        }
+        return std::rename(tmp.c_str(), filename.c_str()) == 0;
+    }
+
+    bool enabled() const { return enabled_; }
+
+    // Called for every successful transfer.
+    void record(HostId host, std::chrono::microseconds ttfb, std::chrono::microseconds total, curl_off_t bytes,
+                long http_version) {
+        if (!enabled_) return;
+        const double ttfb_ms = ttfb.count() / 1000.0, total_ms = total.count() / 1000.0;
+        const double body_ms = total_ms - ttfb_ms;
+        std::lock_guard<std::mutex> lock(mtx_);
+        Profile& profile = profileFor(host);
+        const double alpha = profile.transfers == 0 ? 1.0 : kAlpha;
+        profile.ttfb_ms += alpha * (ttfb_ms - profile.ttfb_ms);
+        profile.total_ms += alpha * (total_ms - profile.total_ms);
+        profile.bytes += alpha * (static_cast<double>(bytes) - profile.bytes);
+        // Bodies that arrive in one burst say nothing about throughput.
+        if (body_ms >= kMinBodyMs && bytes > 0) {
+            const double rate = bytes * 1000.0 / body_ms;
+            profile.bytes_per_sec += (profile.bytes_per_sec > 0 ? kAlpha : 1.0) * (rate - profile.bytes_per_sec);
+        }
+        if (ttfb.count() > 0) profile.ttfb[LatencyHistogram::bucketFor(ttfb)]++;
+        if (http_version != CURL_HTTP_VERSION_NONE) profile.http_version = http_version;
+        ++profile.transfers;
+    }
+
+    // Called for every finished download attempt, successful or not.
+    void recordAttempt(HostId host, bool ok) {
+        if (!enabled_) return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        Profile& profile = profileFor(host);
+        profile.error_rate += (profile.attempts == 0 ? 1.0 : kAlpha) * ((ok ? 0.0 : 1.0) - profile.error_rate);
+        ++profile.attempts;
+        ++profile.run_attempts;
+    }
+
+    void recordRateLimit(HostId host, uint64_t retry_after_s) {
+        if (!enabled_) return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        Profile& profile = profileFor(host);
+        ++profile.rate_limited;
+        if (retry_after_s > 0) profile.retry_after_s = retry_after_s;
+    }
+
+    // Expected milliseconds for a transfer from host; size is -1 when unknown.
+    // Hosts without history get unknown_ms.
+    double expectedMs(HostId host, curl_off_t size, double unknown_ms) const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (host >= profiles_.size() || profiles_[host].transfers == 0) return unknown_ms;
+        const Profile& profile = profiles_[host];
+        if (size >= 0 && profile.bytes_per_sec > 0) return profile.ttfb_ms + size * 1000.0 / profile.bytes_per_sec;
+        return profile.total_ms;
+    }
+
+    // Mean expected time over every known host; 0 without history.
+    double typicalMs() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        double sum = 0;
+        size_t known = 0;
+        for (const Profile& profile : profiles_) {
+            if (profile.transfers == 0) continue;
+            sum += profile.total_ms;
+            ++known;
+        }
+        return known == 0 ? 0 : sum / known;
+    }
+
+    // p99 time to first byte and the expected body time for size bytes (-1 =
+    // the host's average), from the host's history. False until the host has
+    // kMinTimeoutSamples samples.
+    bool latencyEstimate(HostId host, curl_off_t size, double& ttfb_p99_ms, double& body_ms) const {
+        if (!enabled_) return false;
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (host >= profiles_.size()) return false;
+        const Profile& profile = profiles_[host];
+        uint64_t samples = 0;
+        for (uint64_t count : profile.ttfb) samples += count;
+        if (samples < kMinTimeoutSamples) return false;
+        ttfb_p99_ms = LatencyHistogram::percentile(profile.ttfb, 99).count() / 1000.0;
+        const double bytes = size >= 0 ? static_cast<double>(size) : profile.bytes;
+        body_ms = profile.bytes_per_sec > 0 ? bytes * 1000.0 / profile.bytes_per_sec : 0;
+        return true;
+    }
+
+    // Hosts last seen on HTTP/2 or later, whose requests should wait to
+    // multiplex on an existing connection rather than open a new one.
+    bool multiplexes(HostId host) const {
+        if (!enabled_) return false;
+        std::lock_guard<std::mutex> lock(mtx_);
+        return host < profiles_.size() && profiles_[host].http_version >= CURL_HTTP_VERSION_2_0;
+    }
+
+    // Both by HostId.
+    std::vector<Buckets> ttfbHistograms() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::vector<Buckets> histograms;
+        histograms.reserve(profiles_.size());
+        for (const Profile& profile : profiles_) histograms.push_back(profile.ttfb);
+        return histograms;
+    }
+
+    std::vector<size_t> concurrencyLimits() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::vector<size_t> limits;
+        limits.reserve(profiles_.size());
+        for (const Profile& profile : profiles_) limits.push_back(profile.concurrency_limit);
+        return limits;
+    }
+
+    // throttled holds, by HostId, the limits hosts were cut to by rate
+    // limiting during this run (0 = not throttled). Every other remembered
+    // limit of a host contacted this run is raised by one, so a host that has
+    // stopped rate limiting is slowly given its concurrency back; hosts with
+    // no traffic keep theirs.
+    void updateConcurrencyLimits(const std::vector<size_t>& throttled) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (HostId host = 0; host < throttled.size(); ++host) {
+            if (throttled[host] > 0) profileFor(host);
+        }
+        for (HostId host = 0; host < profiles_.size(); ++host) {
+            Profile& profile = profiles_[host];
+            if (host < throttled.size() && throttled[host] > 0) {
+                profile.concurrency_limit = throttled[host];
+            } else if (profile.concurrency_limit > 0 && profile.run_attempts > 0 &&
+                       ++profile.concurrency_limit > kMaxLearnedLimit) {
+                profile.concurrency_limit = 0;
+            }
+        }
+    }
+
+private:
+    struct Profile {
+        uint64_t transfers = 0;
+        double ttfb_ms = 0;
+        double total_ms = 0;
+        double bytes = 0;
+        double bytes_per_sec = 0;  // 0 = not measured yet
+        uint64_t attempts = 0;
+        uint64_t run_attempts = 0;  // attempts in this run; not saved
+        double error_rate = 0;
+        uint64_t rate_limited = 0;     // 429 / 503 + Retry-After responses
+        uint64_t retry_after_s = 0;    // latest Retry-After seen
+        size_t concurrency_limit = 0;  // 0 = none learned
+        long http_version = CURL_HTTP_VERSION_NONE;
+        Buckets ttfb{};
+        bool known = false;  // loaded or recorded; only known profiles are saved
+    };
+
+    static constexpr double kAlpha = 0.2;
+    static constexpr double kMinBodyMs = 10;
+    static constexpr uint64_t kMaxSamples = 1000;
+    static constexpr size_t kMaxLearnedLimit = 32;
+    static constexpr uint64_t kMinTimeoutSamples = 20;
+
+    HostProfiles() = default;
+
+    Profile& profileFor(HostId host) {
+        if (host >= profiles_.size()) profiles_.resize(host + 1);
+        profiles_[host].known = true;
+        return profiles_[host];
+    }
+
+    mutable std::mutex mtx_;
+    std::atomic<bool> enabled_{false};
+    std::vector<Profile> profiles_;  // by HostId
+};
+
+// Success bookkeeping shared by both engines: the TTFB histogram behind
+// --hedge and the persisted host profile.
+void recordTransferStats(CURL* handle, HostId host) {
+    curl_off_t total = 0, bytes = 0;
+    long http_version = CURL_HTTP_VERSION_NONE;
+    curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    curl_easy_getinfo(handle, CURLINFO_HTTP_VERSION, &http_version);
+    const std::chrono::microseconds ttfb = timeToFirstByte(handle);
+    TtfbTracker::getInstance().record(host, ttfb);
+    HostProfiles::getInstance().record(host, ttfb, std::chrono::microseconds(total), bytes, http_version);
+}
+
+// Header-time and write-time limits that reject unwanted responses before
+// (or while) their body streams to disk. Zero/empty means unlimited.
+struct ResponseFilter {
+    std::vector<std::string> allowed_content_types;  // media types, e.g. "text/html"
+    curl_off_t max_content_length = 0;
+    size_t max_body_bytes = 0;
+
+    // Responses without a Content-Type header are let through.
+    bool allowsContentType(std::string_view content_type) const {
+        if (allowed_content_types.empty()) return true;
+        std::string media_type = toLower(std::string(trim(content_type.substr(0, content_type.find(';')))));
+        for (const std::string& allowed : allowed_content_types) {
+            if (media_type == allowed) return true;
+        }
+        return false;
+    }
+};
+
+// Optional HEAD pass over the whole list before downloading, used to plan
+// the batch: permanent redirects are collapsed to their target, objects the
+// filter would reject are reported and skipped, large range-capable objects
+// are split into parallel segments, and small objects on the same host share
+// one task and connection.
+struct ProbeOptions {
+    bool enabled = false;
+    size_t concurrency = 64;
+    curl_off_t segment_threshold = 8 * 1024 * 1024;
+    size_t max_segments = 4;
+    curl_off_t small_object_bytes = 64 * 1024;
+    size_t small_batch_size = 8;
+};
+
+// Where results land. Flat keeps everything in one directory; HashSharded
+// spreads files over 256^shard_levels subdirectories keyed by a hash of the
+// URL so no directory grows without bound; ByHost groups files per host.
+struct OutputOptions {
+    enum class Layout { Flat, HashSharded, ByHost };
+
+    std::string directory = ".";
+    Layout layout = Layout::Flat;
+    size_t shard_levels = 2;
+    bool url_names = false;                // name files after the URL instead of pageN.html
+    std::string index_file = "index.tsv";  // URL -> path map written under directory; empty disables
+};
+
+// Failure taxonomy. Each class has its own retry policy, so a 404, an
+// NXDOMAIN or a bad certificate costs one attempt while resets, timeouts and
+// overloaded servers are retried with backoff.
+enum class ErrorClass { None, Transient, Server, Client, Dns, Tls, LocalIo, Rejected, Count };
+
+constexpr size_t kErrorClassCount = static_cast<size_t>(ErrorClass::Count);
+
+const char* errorClassName(ErrorClass error_class) {
+    switch (error_class) {
+    case ErrorClass::None: return "none";
+    case ErrorClass::Transient: return "transient";
+    case ErrorClass::Server: return "server";
+    case ErrorClass::Client: return "client";
+    case ErrorClass::Dns: return "dns";
+    case ErrorClass::Tls: return "tls";
+    case ErrorClass::LocalIo: return "local-io";
+    case ErrorClass::Rejected: return "rejected";
+    case ErrorClass::Count: break;
+    }
+    return "unknown";
+}
+
+std::optional<ErrorClass> errorClassFromName(std::string_view name) {
+    for (size_t i = 0; i < kErrorClassCount; ++i) {
+        if (name == errorClassName(static_cast<ErrorClass>(i))) return static_cast<ErrorClass>(i);
+    }
+    return std::nullopt;
+}
+
+// Rejections by the response filter are classified by the caller, which
+// knows about them; everything else follows from the result code and status.
+ErrorClass classifyError(CURLcode code, long http_status) {
+    if (code == CURLE_OK) return ErrorClass::None;
+    if (code == CURLE_HTTP_RETURNED_ERROR || http_status >= 400) {
+        if (http_status >= 500 || http_status == 429 || http_status == 408) return ErrorClass::Server;
+        if (http_status >= 400) return ErrorClass::Client;
+    }
+    switch (code) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_RESOLVE_PROXY:
+        return ErrorClass::Dns;
+    case CURLE_PEER_FAILED_VERIFICATION:
+    case CURLE_SSL_CERTPROBLEM:
+    case CURLE_SSL_CIPHER:
+    case CURLE_SSL_CACERT_BADFILE:
+    case CURLE_SSL_ENGINE_NOTFOUND:
+    case CURLE_SSL_ENGINE_SETFAILED:
+    case CURLE_SSL_ENGINE_INITFAILED:
+    case CURLE_SSL_ISSUER_ERROR:
+    case CURLE_SSL_PINNEDPUBKEYNOTMATCH:
+    case CURLE_SSL_INVALIDCERTSTATUS:
+    case CURLE_SSL_CRL_BADFILE:
+    case CURLE_USE_SSL_FAILED:
+        return ErrorClass::Tls;
+    case CURLE_WRITE_ERROR:
+    case CURLE_READ_ERROR:
+    case CURLE_FILE_COULDNT_READ_FILE:
+    case CURLE_OUT_OF_MEMORY:
+    case CURLE_FAILED_INIT:
+        return ErrorClass::LocalIo;
+    case CURLE_URL_MALFORMAT:
+    case CURLE_UNSUPPORTED_PROTOCOL:
+    case CURLE_TOO_MANY_REDIRECTS:
+    case CURLE_RANGE_ERROR:
+        return ErrorClass::Client;
+    default:
+        // Connect failures, resets, timeouts, TLS handshakes cut short,
+        // truncated bodies, proxy hiccups.
+        return ErrorClass::Transient;
+    }
+}
+
+struct RetryPolicy {
+    int max_attempts = 1;
+    std::chrono::milliseconds delay{100};  // multiplied by the attempt number
+};
+
+// Failed attempts and final failures per class, logged at exit.
+class ErrorCounters {
+public:
+    static ErrorCounters& getInstance() {
+        static ErrorCounters instance;
+        return instance;
+    }
+
+    ErrorCounters(ErrorCounters const&) = delete;
+    void operator=(ErrorCounters const&) = delete;
+
+    void recordAttempt(ErrorClass error_class) { attempts_[static_cast<size_t>(error_class)]++; }
+    void recordFailure(ErrorClass error_class) { failures_[static_cast<size_t>(error_class)]++; }
+
+    std::string summary() const {
+        std::string text;
+        for (size_t i = 1; i < kErrorClassCount; ++i) {
+            if (attempts_[i] == 0 && failures_[i] == 0) continue;
+            text += (text.empty() ? "" : ", ") + std::string(errorClassName(static_cast<ErrorClass>(i))) + " " +
+                    std::to_string(attempts_[i].load()) + " attempts/" + std::to_string(failures_[i].load()) + " URLs";
+        }
+        return text.empty() ? "Failures: none" : "Failures by class: " + text;
+    }
+
+private:
+    ErrorCounters() = default;
+    std::array<std::atomic<uint64_t>, kErrorClassCount> attempts_{};
+    std::array<std::atomic<uint64_t>, kErrorClassCount> failures_{};
+};
+
+// Everything tunable about a run. Built once at startup by parseOptions()
+// (config file, then command-line flags), validated, and then only ever
+// passed to workers by const reference.
+struct DownloadOptions {
+    enum class Engine { Threads, Async };
+    enum class Schedule { Fifo, LongestFirst };
+
+    std::string input_file = "urls.txt";
+    std::string log_file = "errors_and_logs.log";
+    std::string trace_file = "trace.json";  // used when built with DOWNLOADER_TRACING
+    bool json_results = false;              // one JSON line per URL on stdout; implied by streaming input
+
+    Engine engine = Engine::Threads;
+    size_t threads = 0;  // 0 = derived from the list size and hardware concurrency
+    size_t event_loops = 2;
+    size_t max_in_flight = 64;  // per event loop
+    bool pin_workers = false;
+    std::chrono::seconds stats_interval{5};
+    Schedule schedule = Schedule::LongestFirst;  // batch dispatch order; needs host profiles
+
+    int max_retries = 3;                         // attempts for transient and server errors
+    std::chrono::milliseconds retry_delay{100};  // multiplied by the attempt number
+    std::array<std::optional<RetryPolicy>, kErrorClassCount> retry_policies;  // per-class overrides
+    std::string failures_file;  // failed URLs as re-runnable JSON lines; empty = none
+    std::string retry_failed;   // re-run the failures in this file instead of the input
+    std::vector<ErrorClass> retry_classes = {ErrorClass::Transient, ErrorClass::Server, ErrorClass::Dns,
+                                             ErrorClass::Tls, ErrorClass::LocalIo};
+    long timeout_secs = 30;
+    long connect_timeout_secs = 0;  // 0 = libcurl default
+    long low_speed_limit = 10;      // bytes/s ...
+    long low_speed_time = 5;        // ... sustained for this many seconds aborts
+    bool adaptive_timeouts = true;  // per-host timeouts from the host profiles, within the limits below
+    long max_timeout_secs = 600;    // cap on a whole-transfer timeout stretched for a large body
+
+    OutputOptions output;
+    ResponseFilter filter;
+    ProbeOptions probe;
+    std::string redirect_cache_file = "redirect_cache.tsv";  // empty disables the cache
+    std::chrono::seconds redirect_cache_ttl = std::chrono::hours(24 * 7);
+    std::string hsts_cache_file = "hsts_cache.txt";      // empty disables HSTS persistence
+    std::string altsvc_cache_file = "altsvc_cache.txt";  // empty disables Alt-Svc
+    std::string host_profiles_file = "host_profiles.tsv"; // empty disables per-host history
+    size_t max_open_files = 0;                           // output files open at once; 0 = half of RLIMIT_NOFILE
+    curl_off_t max_bytes_per_sec = 0;                    // whole-process receive rate; 0 = unlimited
+    curl_off_t max_host_bytes_per_sec = 0;               // receive rate per host; 0 = unlimited
+    size_t max_per_host = 0;                             // concurrent transfers per host; 0 = unlimited
+    bool share_connections = false;                      // one DNS/TLS-session cache for all handles; warm per-worker handles
+    std::vector<ProxyPool::Proxy> proxies;               // egress proxy pool; empty = direct (or libcurl's env proxy)
+    bool cookies = false;                                // one cookie jar shared by all workers
+    std::string cookie_jar_file;                         // persists the jar; implies cookies
+    std::string daemon_socket;                           // non-empty runs as a daemon on this Unix socket
+    bool hedge = false;                                  // duplicate requests stuck past the host's TTFB percentile
+    unsigned hedge_percentile = 95;
+    unsigned hedge_min_samples = 20;                     // TTFB samples a host needs before hedging
+};
+
+// Transient and server errors get options.max_retries attempts by default;
+// permanent classes get exactly one.
+RetryPolicy retryPolicyFor(ErrorClass error_class, const DownloadOptions& options) {
+    if (const std::optional<RetryPolicy>& custom = options.retry_policies[static_cast<size_t>(error_class)]) {
+        return *custom;
+    }
+    const bool retryable = error_class == ErrorClass::Transient || error_class == ErrorClass::Server;
+    return {retryable ? options.max_retries : 1, options.retry_delay};
+}
+
+// Backoff for the given (1-based) retry, stretched to honor a server's
+// Retry-After in seconds, up to a minute.
+std::chrono::milliseconds retryDelay(const RetryPolicy& policy, int retry, std::string_view retry_after) {
+    std::chrono::milliseconds delay = policy.delay * retry;
+    uint64_t seconds = 0;
+    std::string digits(trim(retry_after));
+    if (!digits.empty() && digits.find_first_not_of("0123456789") == std::string::npos && digits.size() < 6) {
+        seconds = std::strtoull(digits.c_str(), nullptr, 10);
+    }
+    return std::max(delay, std::chrono::milliseconds(std::min<uint64_t>(seconds, 60) * 1000));
+}
+
+struct TransferTimeouts {
+    long total_secs = 0;
+    long connect_ms = 0;  // 0 = libcurl default
+    long low_speed_secs = 0;
+};
+
+// Per-host timeouts once the host has enough history. Connects and stalls
+// are cut at a few times the host's p99 time to first byte, floored at 1s
+// and 2s and never above the configured values, so a hung connection to a
+// fast host fails in seconds; each retry scales them up by its attempt
+// number, so a request that is just slower than usual still gets through.
+// The whole-transfer timeout only grows, to 4x the expected time for the
+// body, up to max_timeout_secs.
+TransferTimeouts timeoutsFor(HostId host, curl_off_t expected_bytes, int attempt, const DownloadOptions& options) {
+    TransferTimeouts timeouts{options.timeout_secs, options.connect_timeout_secs * 1000, options.low_speed_time};
+    double ttfb_p99_ms = 0, body_ms = 0;
+    if (!options.adaptive_timeouts || !HostProfiles::getInstance().latencyEstimate(host, expected_bytes, ttfb_p99_ms, body_ms)) {
+        return timeouts;
+    }
+    const long connect_cap_ms = options.connect_timeout_secs > 0 ? options.connect_timeout_secs * 1000 : 30000;
+    const double scale = std::max(1, attempt);
+    timeouts.connect_ms = std::clamp(static_cast<long>(3 * scale * ttfb_p99_ms), std::min(1000L, connect_cap_ms), connect_cap_ms);
+    timeouts.low_speed_secs = std::clamp(static_cast<long>(std::ceil(4 * scale * ttfb_p99_ms / 1000)),
+                                         std::min(2L * attempt, options.low_speed_time), options.low_speed_time);
+    const double expected_secs = (ttfb_p99_ms + body_ms) / 1000;
+    timeouts.total_secs = std::clamp(static_cast<long>(std::ceil(4 * expected_secs)), options.timeout_secs, options.max_timeout_secs);
+    return timeouts;
+}
+
+using HeaderList = std::vector<std::pair<std::string, std::string>>;
+
+// Header names are stored lower-cased.
+std::string_view findHeader(const HeaderList& headers, std::string_view name) {
+    for (const auto& header : headers) {
+        if (header.first == name) return header.second;
+    }
+    return {};
+}
+
+// Per-attempt bookkeeping shared by both engines, called while the attempt
+// still holds its HostLimiter slot: error rate, and rate-limit signals (429,
+// or 503 with Retry-After) that throttle the host.
+void recordAttemptOutcome(HostId host, CURLcode code, long http_status, const HeaderList& headers) {
+    HostProfiles& profiles = HostProfiles::getInstance();
+    profiles.recordAttempt(host, code == CURLE_OK);
+    const std::string_view retry_after = findHeader(headers, "retry-after");
+    if (http_status == 429 || (http_status == 503 && !retry_after.empty())) {
+        HostLimiter::getInstance().onRateLimited(host);
+        profiles.recordRateLimit(host, std::strtoull(std::string(retry_after).c_str(), nullptr, 10));
+    }
+}
+
+// Interns request header lists: every distinct set of header lines is built
+// into one curl_slist the first time it is seen and then shared, read-only,
+// by every transfer that uses it until the process exits.
+class HeaderListCache {
+public:
+    static HeaderListCache& getInstance() {
+        static HeaderListCache instance;
+        return instance;
+    }
+
+    HeaderListCache(HeaderListCache const&) = delete;
+    void operator=(HeaderListCache const&) = delete;
+
+    // Lines are "Name: value"; order is preserved. nullptr for an empty set.
+    curl_slist* intern(const std::vector<std::string>& lines) {
+        if (lines.empty()) return nullptr;
+        std::string key;
+        for (const std::string& line : lines) key += line + '\n';
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = lists_.find(key);
+        if (it != lists_.end()) return it->second;
+        curl_slist* list = nullptr;
+        for (const std::string& line : lines) {
+            curl_slist* extended = curl_slist_append(list, line.c_str());
+            if (!extended) {
+                curl_slist_free_all(list);
+                return nullptr;
+            }
+            list = extended;
+        }
+        lists_.emplace(std::move(key), list);
+        return list;
+    }
+
+    ~HeaderListCache() {
+        for (auto& entry : lists_) curl_slist_free_all(entry.second);
+    }
+
+private:
+    HeaderListCache() = default;
+    std::mutex mtx_;
+    std::unordered_map<std::string, curl_slist*> lists_;
+};
+
+// Per-URL request details from a JSON input line. A URL without one is a
+// plain GET with libcurl's default headers.
+struct RequestSpec {
+    std::string method;               // empty: GET, or POST when there is a body
+    curl_slist* headers = nullptr;    // interned by HeaderListCache
+    std::string cookies;              // Cookie header value
+    std::optional<std::string> body;
+};
+
+using RequestSpecPtr = std::shared_ptr<const RequestSpec>;
+
+// Only safe methods are duplicated by --hedge; a second POST could repeat its side effects.
+bool isHedgeable(const RequestSpec* request) {
+    return !request || (!request->body && (request->method.empty() || request->method == "GET" || request->method == "HEAD"));
+}
+
+// Per-attempt state handed to libcurl callbacks. The body goes to output when
+// set, otherwise it is appended to body. A non-empty rejection means the
+// filter aborted the transfer on purpose and it must not be retried.
+// Callbacks on an event loop must not block (may_block=false): they pause the
+// transfer and push easy onto pause_queue for the loop to resume later.
+struct TransferContext {
+    const RequestSpec* request = nullptr;
+    std::string proxy;  // leased from ProxyPool; empty = libcurl's default
+    OutputFile* output = nullptr;
+    std::string* body = nullptr;
+    bool may_block = true;
+    CURL* easy = nullptr;
+    std::vector<CURL*>* pause_queue = nullptr;
+    HostId host = HostTable::kNoHost;  // key for per-host limits and statistics; set by the caller
+    curl_off_t expected_bytes = -1;  // body size when known up front (ranged segments); sizes adaptive timeouts
+    int attempt = 1;                 // retries get proportionally looser adaptive timeouts
+    const ResponseFilter* filter = nullptr;
+    bool headers_only = false;  // abort at the first body byte (probe by GET)
+    long response_status = 0;
+    bool temporary_redirect = false;  // some hop in the chain was not 301/308
+    std::string content_type;
+    HeaderList headers;  // of the latest response in the redirect chain
+    std::string rejection;
+    std::vector<HstsStore::Entry> hsts_preload;  // fed to libcurl before the request
+    size_t hsts_next = 0;
+    size_t bytes_written = 0;
+    Tracer::Clock::time_point first_write{};
+    Tracer::Clock::duration write_time{};
+};
+
+size_t write_data(void *ptr, size_t size, size_t nmemb, TransferContext *ctx) {
+    if (ctx->headers_only) return 0;
+    if (ctx->filter && ctx->filter->max_body_bytes > 0 &&
+        ctx->bytes_written + size * nmemb > ctx->filter->max_body_bytes) {
+        ctx->rejection = "body exceeds " + std::to_string(ctx->filter->max_body_bytes) + " bytes";
+        return 0;
+    }
+    if (ctx->output && !ctx->output->isOpen()) {
+        OutputFile::OpenStatus status = ctx->output->open(ctx->may_block);
+        if (status == OutputFile::OpenStatus::WouldBlock) {
+            ctx->pause_queue->push_back(ctx->easy);
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        if (status == OutputFile::OpenStatus::Failed) return 0;
+    }
+    BandwidthLimiter& limiter = BandwidthLimiter::getInstance();
+    if (limiter.enabled()) {
+        if (ctx->may_block) {
+            limiter.acquire(ctx->host, size * nmemb);
+        } else if (!limiter.tryAcquire(ctx->host, size * nmemb)) {
+            ctx->pause_queue->push_back(ctx->easy);
+            return CURL_WRITEFUNC_PAUSE;
+        }
+    }
+
+    Tracer::Clock::time_point write_start{};
+    if constexpr (kTracingEnabled) {
+        write_start = Tracer::Clock::now();
+        if (ctx->bytes_written == 0) ctx->first_write = write_start;
+    }
+    size_t written;
+    if (ctx->output) {
+        written = fwrite(ptr, size, nmemb, ctx->output->get());
+    } else {
+        ctx->body->append(static_cast<const char*>(ptr), size * nmemb);
+        written = nmemb;
+    }
+    ctx->bytes_written += written * size;
+    if constexpr (kTracingEnabled) {
+        ctx->write_time += Tracer::Clock::now() - write_start;
+    }
+    return written;
+}
+
+// Called once per header line of every response in a redirect chain; only a
+// successful (2xx) final response is checked, so error responses keep their
+// status classification and retries. Returning 0 aborts before the body.
+size_t header_data(char* buffer, size_t size, size_t nitems, TransferContext* ctx) {
+    const size_t length = size * nitems;
+    std::string_view line(buffer, length);
+    if (line.rfind("HTTP/", 0) == 0) {
+        size_t space = line.find(' ');
+        ctx->response_status = space == std::string_view::npos ? 0 : std::atol(std::string(line.substr(space + 1, 3)).c_str());
+        if (ctx->response_status >= 300 && ctx->response_status < 400 && ctx->response_status != 301 &&
+            ctx->response_status != 308) {
+            ctx->temporary_redirect = true;
+        }
+        ctx->content_type.clear();
+        ctx->headers.clear();
+        return length;
+    }
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos) return length;
+    std::string name = toLower(std::string(trim(line.substr(0, colon))));
+    std::string_view value = trim(line.substr(colon + 1));
+    if (name == "content-type") ctx->content_type = std::string(value);
+    ctx->headers.emplace_back(name, std::string(value));
+
+    const bool success = ctx->response_status >= 200 && ctx->response_status < 300;
+    if (!ctx->filter || !success) return length;
+
+    if (name == "content-type" && !ctx->filter->allowsContentType(value)) {
+        ctx->rejection = "content type " + std::string(value) + " not allowed";
+        return 0;
+    }
+    if (name == "content-length" && ctx->filter->max_content_length > 0) {
+        curl_off_t content_length = std::strtoll(std::string(value).c_str(), nullptr, 10);
+        if (content_length > ctx->filter->max_content_length) {
+            ctx->rejection = "content length " + std::to_string(content_length) + " exceeds " +
+                             std::to_string(ctx->filter->max_content_length);
+            return 0;
+        }
+    }
+    return length;
+}
+
+CURLSTScode hsts_read(CURL*, struct curl_hstsentry* sts, void* userp) {
+    TransferContext* ctx = static_cast<TransferContext*>(userp);
+    while (ctx->hsts_next < ctx->hsts_preload.size()) {
+        const HstsStore::Entry& entry = ctx->hsts_preload[ctx->hsts_next++];
+        if (entry.host.size() + 1 > sts->namelen) continue;
+        std::memcpy(sts->name, entry.host.c_str(), entry.host.size() + 1);
+        sts->includeSubDomains = entry.include_subdomains;
+        std::snprintf(sts->expire, sizeof(sts->expire), "%s", entry.expire.c_str());
+        return CURLSTS_OK;
+    }
+    return CURLSTS_DONE;
+}
+
+// libcurl hands over its whole HSTS cache when a handle is cleaned up.
+CURLSTScode hsts_write(CURL*, struct curl_hstsentry* sts, struct curl_index*, void*) {
+    HstsStore::getInstance().record(sts->name, sts->includeSubDomains, sts->expire);
+    return CURLSTS_OK;
+}
+
+// Records the Alt-Svc header of a successful transfer's final response.
+void recordAltSvc(CURL* handle, const TransferContext& ctx) {
+    AltSvcStore& store = AltSvcStore::getInstance();
+    const std::string_view header = findHeader(ctx.headers, "alt-svc");
+    if (!store.enabled() || header.empty()) return;
+    char* effective_url = nullptr;
+    curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+    if (effective_url) store.record(altSvcOrigin(effective_url), header);
+}
+
+// Remembers where a successful transfer ended up when every hop was permanent.
+void learnRedirect(CURL* handle, const std::string& url, const TransferContext& ctx) {
+    long redirects = 0;
+    char* effective_url = nullptr;
+    curl_easy_getinfo(handle, CURLINFO_REDIRECT_COUNT, &redirects);
+    curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+    if (redirects > 0 && effective_url && !ctx.temporary_redirect) {
+        RedirectCache::getInstance().record(url, effective_url);
+    }
+}
+
+// Splits one finished attempt into DNS/connect/TLS/TTFB/body spans using
+// libcurl's cumulative phase timers. Disk writes interleave with the body, so
+// their summed time is recorded as one span starting at the first write.
+void traceTransfer(CURL* handle, const std::string& url, Tracer::Clock::time_point start,
+                   const TransferContext& ctx) {
+    if constexpr (kTracingEnabled) {
+        curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, ttfb = 0, total = 0;
+        curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+        curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &tls);
+        curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+        curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+        curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+        auto at = [start](curl_off_t us) { return start + std::chrono::microseconds(us); };
+
+        Tracer& tracer = Tracer::getInstance();
+        tracer.span("dns", url, start, at(dns));
+        if (connect > 0) tracer.span("connect", url, at(dns), at(connect));
+        if (tls > 0) tracer.span("tls", url, at(connect), at(tls));
+        if (ttfb > 0) tracer.span("ttfb", url, at(std::max(pretransfer, connect)), at(ttfb));
+        if (total > ttfb) tracer.span("body", url, at(ttfb), at(total));
+        if (ctx.bytes_written > 0) {
+            tracer.span("disk_write", url, ctx.first_write, ctx.first_write + ctx.write_time);
+        }
+    } else {
+        (void)handle; (void)url; (void)start; (void)ctx;
+    }
+}
+
+// Process-wide CURLSH holding the DNS cache and TLS session cache, so every
+// handle on every thread skips repeated lookups and full handshakes (used by
+// the daemon, or with --share-connections), and/or one cookie jar for all
+// workers (--cookies). The connection pool is deliberately not shared:
+// libcurl does not support one connection cache used by concurrent threads.
+// Instead each thread-pool worker keeps a warm handle (see workerHandle())
+// and each event loop its multi handle.
+// The jar is loaded and saved through a dedicated easy handle attached to
+// the share, since libcurl only reads and writes cookie files per handle.
+class CurlShare {
+public:
+    static CurlShare& getInstance() {
+        static CurlShare instance;
+        return instance;
+    }
+
+    CurlShare(CurlShare const&) = delete;
+    void operator=(CurlShare const&) = delete;
+
+    // cookie_file may be empty for an in-memory jar; an existing file is
+    // loaded now. Call once, before any transfer starts.
+    void enable(bool connections, bool cookies, const std::string& cookie_file = "") {
+        if (share_ || (!connections && !cookies)) return;
+        share_ = curl_share_init();
+        if (!share_) {
+            Logger::getInstance().logError("Error initializing shared curl state");
+            return;
+        }
+        curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, lock);
+        curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, unlock);
+        curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+        if (connections) {
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            warm_ = true;
+        }
+        if (cookies) {
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+            cookies_ = true;
+            if (!cookie_file.empty()) jar_ = CurlHandle(curl_easy_init());
+            if (jar_) {
+                cookie_file_ = cookie_file;
+                curl_easy_setopt(jar_.get(), CURLOPT_SHARE, share_);
+                std::error_code ec;
+                if (std::filesystem::exists(cookie_file, ec)) {
+                    curl_easy_setopt(jar_.get(), CURLOPT_COOKIEFILE, cookie_file.c_str());
+                    curl_easy_setopt(jar_.get(), CURLOPT_COOKIELIST, "RELOAD");
+                }
+            }
+        }
+    }
+
+    bool cookiesEnabled() const { return cookies_; }
+    bool warmConnections() const { return warm_; }
+
+    // Writes the shared jar to the cookie file, if one was given.
+    bool saveCookies() {
+        if (!jar_ || cookie_file_.empty()) return true;
+        curl_easy_setopt(jar_.get(), CURLOPT_COOKIEJAR, cookie_file_.c_str());
+        return curl_easy_setopt(jar_.get(), CURLOPT_COOKIELIST, "FLUSH") == CURLE_OK;
+    }
+
+    // Only once no transfer handle refers to the share any more.
+    void cleanup() {
+        if (jar_) {
+            curl_easy_setopt(jar_.get(), CURLOPT_COOKIEJAR, nullptr);  // saveCookies() already wrote it
+            jar_ = CurlHandle();
+        }
+        if (share_) curl_share_cleanup(share_);
+        share_ = nullptr;
+    }
+
+    CURLSH* get() const { return share_; }
+
+private:
+    CurlShare() = default;
+
+    static void lock(CURL*, curl_lock_data data, curl_lock_access, void* userp) {
+        static_cast<CurlShare*>(userp)->locks_[static_cast<size_t>(data) % kLocks].lock();
+    }
+    static void unlock(CURL*, curl_lock_data data, void* userp) {
+        static_cast<CurlShare*>(userp)->locks_[static_cast<size_t>(data) % kLocks].unlock();
+    }
+
+    static constexpr size_t kLocks = CURL_LOCK_DATA_LAST;
+    CURLSH* share_ = nullptr;
+    bool cookies_ = false;
+    bool warm_ = false;  // workers keep their handles (and connections) across tasks
+    CurlHandle jar_;
+    std::string cookie_file_;
+    std::array<std::mutex, kLocks> locks_;
+};
+
+// Options shared by every transfer regardless of which engine drives it.
+void configureTransfer(CURL* handle, const std::string& url, TransferContext& ctx, const DownloadOptions& options) {
+    curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_data);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, &ctx);
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, header_data);
+    curl_easy_setopt(handle, CURLOPT_HEADERDATA, &ctx);
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    const TransferTimeouts timeouts = timeoutsFor(ctx.host, ctx.expected_bytes, ctx.attempt, options);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT, timeouts.total_secs);
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, timeouts.connect_ms);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, options.low_speed_limit);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, timeouts.low_speed_secs);
+    curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    CurlShare& share = CurlShare::getInstance();
+    if (share.get()) curl_easy_setopt(handle, CURLOPT_SHARE, share.get());
+    if (share.cookiesEnabled()) curl_easy_setopt(handle, CURLOPT_COOKIEFILE, "");  // turns on the cookie engine
+    if (!ctx.proxy.empty()) curl_easy_setopt(handle, CURLOPT_PROXY, ctx.proxy.c_str());
+    if (HostProfiles::getInstance().multiplexes(ctx.host)) curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+
+    if (const RequestSpec* request = ctx.request) {
+        if (request->headers) curl_easy_setopt(handle, CURLOPT_HTTPHEADER, request->headers);
+        if (!request->cookies.empty()) curl_easy_setopt(handle, CURLOPT_COOKIE, request->cookies.c_str());
+        // POST is set rather than forced with CUSTOMREQUEST, which keeps
+        // libcurl's browser-like method switch on 301/302/303 redirects.
+        if (request->body || request->method == "POST") {
+            curl_easy_setopt(handle, CURLOPT_POST, 1L);
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE,
+                             static_cast<curl_off_t>(request->body ? request->body->size() : 0));
+            curl_easy_setopt(handle, CURLOPT_POSTFIELDS, request->body ? request->body->data() : "");
+        }
+        if (request->method == "HEAD") {
+            curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+        } else if (!request->method.empty() && request->method != "GET" && request->method != "POST") {
+            curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, request->method.c_str());
+        }
+    }
+
+    static const curl_version_info_data* features = curl_version_info(CURLVERSION_NOW);
+    if (!options.hsts_cache_file.empty() && (features->features & CURL_VERSION_HSTS)) {
+        if (url.rfind("http://", 0) == 0) ctx.hsts_preload = HstsStore::getInstance().entriesFor(HostTable::getInstance().name(ctx.host));
+        curl_easy_setopt(handle, CURLOPT_HSTS_CTRL, static_cast<long>(CURLHSTS_ENABLE));
+        curl_easy_setopt(handle, CURLOPT_HSTSREADFUNCTION, hsts_read);
+        curl_easy_setopt(handle, CURLOPT_HSTSREADDATA, &ctx);
+        curl_easy_setopt(handle, CURLOPT_HSTSWRITEFUNCTION, hsts_write);
+    }
+    if (AltSvcStore::getInstance().enabled()) {
+        const std::string origin = altSvcOrigin(url);
+        std::optional<AltSvcStore::Entry> alt;
+        if (!origin.empty()) alt = AltSvcStore::getInstance().alternativeFor(origin, features->features & CURL_VERSION_HTTP3);
+        if (alt) {
+            if (alt->alpn == "h3") curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_3));
+            const std::string target = alt->host + ":" + std::to_string(alt->port);
+            if (target != origin) {
+                curl_easy_setopt(handle, CURLOPT_CONNECT_TO, HeaderListCache::getInstance().intern({origin + ":" + target}));
+            }
+        }
+    }
+}
+
+// Part of a pre-sized output file; length 0 means the whole body.
+struct ByteRange {
+    curl_off_t offset = 0;
+    curl_off_t length = 0;
+};
+
+struct TransferOutcome {
+    CURLcode code = CURLE_OK;
+    long http_status = 0;
+    std::string rejection;  // non-empty when the response filter aborted the transfer
+    ErrorClass error_class = ErrorClass::None;
+    int attempts = 0;
+
+    bool ok() const { return code == CURLE_OK; }
+};
+
+// The calling thread's multi handle for hedged transfers. It lives as long
+// as the thread, so connections opened by either leg of a hedge stay in its
+// cache for the thread's later attempts.
+CURLM* workerMulti() {
+    struct Multi {
+        CURLM* handle = curl_multi_init();
+        ~Multi() {
+            if (handle) curl_multi_cleanup(handle);
+        }
+    };
+    thread_local Multi multi;
+    return multi.handle;
+}
+
+// Thread-engine hedging: drives primary on the worker's multi handle and, if
+// no response has started after delay (0 = never), adds the duplicate
+// start_hedge() builds (nullptr skips it). Returns the code of the first leg
+// to succeed, or of the primary when both fail; hedge_won tells which leg the
+// caller should use.
+CURLcode performHedged(CURL* primary, const TransferContext& primary_ctx, std::chrono::microseconds delay,
+                       const std::function<CURL*(std::vector<CURL*>&)>& start_hedge, bool& hedge_won) {
+    hedge_won = false;
+    CURLM* multi = workerMulti();
+    if (!multi || curl_multi_add_handle(multi, primary) != CURLM_OK) return curl_easy_perform(primary);
+    const auto deadline = std::chrono::steady_clock::now() + delay;
+    bool deadline_passed = delay.count() <= 0;
+    CURL* hedge = nullptr;
+    std::optional<CURLcode> primary_code, hedge_code;
+    std::vector<CURL*> paused;  // the hedge pauses instead of blocking this loop in its callbacks
+    while (true) {
+        if (!deadline_passed && std::chrono::steady_clock::now() >= deadline) {
+            deadline_passed = true;
+            if (!primary_code && primary_ctx.response_status == 0) {
+                hedge = start_hedge(paused);
+                if (hedge && curl_multi_add_handle(multi, hedge) != CURLM_OK) hedge = nullptr;
+            }
+        }
+        std::vector<CURL*> retry;
+        retry.swap(paused);
+        for (CURL* handle : retry) {
+            curl_easy_pause(handle, CURLPAUSE_CONT);
+        }
+        int running = 0;
+        curl_multi_perform(multi, &running);
+        int pending = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi, &pending)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            (msg->easy_handle == primary ? primary_code : hedge_code) = msg->data.result;
+        }
+        if (primary_code && *primary_code == CURLE_OK) break;
+        if (hedge_code && *hedge_code == CURLE_OK) {
+            hedge_won = true;
+            break;
+        }
+        if (primary_code && (!hedge || hedge_code)) break;
+
+        int timeout_ms = paused.empty() ? 1000 : 10;
+        if (!deadline_passed) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            timeout_ms = static_cast<int>(std::clamp<long long>(wait.count() + 1, 0, timeout_ms));
+        }
+        curl_multi_poll(multi, nullptr, 0, timeout_ms, nullptr);
+    }
+    curl_multi_remove_handle(multi, primary);
+    if (hedge) {
+        curl_multi_remove_handle(multi, hedge);
+        TtfbTracker::getInstance().noteHedge(hedge_won);
+    }
+    return hedge_won ? *hedge_code : *primary_code;
+}
+
+// The calling thread's own easy handle, kept across tasks so its keep-alive
+// connections stay warm. Released when the worker thread exits, which is
+// before CurlShare::cleanup().
+CurlHandle& workerHandle() {
+    thread_local CurlHandle handle;
+    return handle;
+}
+
+// Retry loop shared by whole-file and ranged downloads. When reusable is
+// given its easy handle (and so its keep-alive connections) is reset and
+// reused instead of creating a fresh one per attempt. The caller holds a
+// HostLimiter slot for url's host (see runWithHostSlot()), which is given
+// back during retry backoffs; a hedge takes a second one only if it is free.
+TransferOutcome transferToFile(const std::string& url, HostId host, const std::string& filename, const DownloadOptions& options,
+                               CurlHandle* reusable = nullptr, const ByteRange& range = {},
+                               const RequestSpec* request = nullptr) {
+    Logger& logger = Logger::getInstance();
+    ProxyPool& proxies = ProxyPool::getInstance();
+    ErrorCounters& counters = ErrorCounters::getInstance();
+    HostLimiter& limiter = HostLimiter::getInstance();
+    int retries = 0;
+    int proxy = -1;  // of the previous attempt, which a retry avoids
+    TransferOutcome outcome;
+    if (!reusable && CurlShare::getInstance().warmConnections()) reusable = &workerHandle();
+
+    do {
+        ++outcome.attempts;
+        CurlHandle fresh_handle;
+        CurlHandle& curl_handle = reusable ? *reusable : fresh_handle;
+        if (curl_handle) {
+            curl_easy_reset(curl_handle.get());
+        } else {
+            curl_handle = CurlHandle(curl_easy_init());
+        }
+        if (!curl_handle) {
+            logger.logError("Error initializing CURL for " + url);
+            outcome.code = CURLE_FAILED_INIT;
+            return outcome;
+        }
+
+        OutputFile output(filename, range.length > 0 ? range.offset : -1);
+        TransferContext ctx;
+        ctx.host = host;
+        ctx.request = request;
+        ctx.output = &output;
+        ctx.filter = &options.filter;
+        if (range.length > 0) ctx.expected_bytes = range.length;
+        ctx.attempt = outcome.attempts;
+        if (proxies.enabled()) {
+            proxy = proxies.acquire(proxy);
+            ctx.proxy = proxies.url(proxy);
+        }
+        configureTransfer(curl_handle.get(), url, ctx, options);
+        std::string range_spec;
+        if (range.length > 0) {
+            range_spec = std::to_string(range.offset) + "-" + std::to_string(range.offset + range.length - 1);
+            curl_easy_setopt(curl_handle.get(), CURLOPT_RANGE, range_spec.c_str());
+        }
+        // The duplicate of a hedged attempt, built only once the primary stalls.
+        CurlHandle hedge_handle;
+        std::optional<OutputFile> hedge_output;
+        TransferContext hedge_ctx;
+        int hedge_proxy = -1;
+        bool hedge_slot = false;
+        bool hedge_won = false;
+        auto start_hedge = [&](std::vector<CURL*>& paused) -> CURL* {
+            if (!limiter.tryAcquire(host)) return nullptr;
+            hedge_slot = true;
+            if (proxies.enabled()) {
+                hedge_proxy = proxies.tryAcquire(proxy);
+                if (hedge_proxy < 0) return nullptr;
+                hedge_ctx.proxy = proxies.url(hedge_proxy);
+            }
+            hedge_handle = CurlHandle(curl_easy_init());
+            if (!hedge_handle) return nullptr;
+            hedge_output.emplace(filename, -1, ".hedge.part");
+            hedge_ctx.host = host;
+            hedge_ctx.request = request;
+            hedge_ctx.output = &*hedge_output;
+            hedge_ctx.filter = &options.filter;
+            hedge_ctx.may_block = false;
+            hedge_ctx.easy = hedge_handle.get();
+            hedge_ctx.pause_queue = &paused;
+            configureTransfer(hedge_handle.get(), url, hedge_ctx, options);
+            curl_easy_setopt(hedge_handle.get(), CURLOPT_FRESH_CONNECT, 1L);
+            return hedge_handle.get();
+        };
+        const std::chrono::microseconds hedge_delay = range.length == 0 && isHedgeable(request)
+                                                          ? TtfbTracker::getInstance().hedgeDelay(ctx.host)
+                                                          : std::chrono::microseconds(0);
+        Tracer::Clock::time_point attempt_start = Tracer::Clock::now();
+        if (options.hedge) {
+            // Unhedged attempts go through the worker's multi handle too, so
+            // all of them share one pool of keep-alive connections.
+            outcome.code = performHedged(curl_handle.get(), ctx, hedge_delay, start_hedge, hedge_won);
+        } else {
+            outcome.code = curl_easy_perform(curl_handle.get());
+        }
+        CURL* handle = hedge_won ? hedge_handle.get() : curl_handle.get();
+        TransferContext& winner_ctx = hedge_won ? hedge_ctx : ctx;
+        OutputFile& winner_output = hedge_won ? *hedge_output : output;
+        traceTransfer(curl_handle.get(), url, attempt_start, ctx);
+        if (hedge_handle) traceTransfer(hedge_handle.get(), url, attempt_start, hedge_ctx);
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &outcome.http_status);
+        recordAttemptOutcome(host, outcome.code, outcome.http_status, winner_ctx.headers);
+        if (hedge_slot) limiter.release(host);
+        // Only the leg whose result is used reports proxy health; the other was cut short.
+        const bool proxy_ok = !isProxyFailure(outcome.code, outcome.http_status);
+        if (proxy >= 0) {
+            proxies.release(proxy, hedge_won || proxy_ok, timeToFirstByte(curl_handle.get()));
+        }
+        if (hedge_proxy >= 0) {
+            proxies.release(hedge_proxy, !hedge_won || proxy_ok, hedge_handle ? timeToFirstByte(hedge_handle.get())
+                                                                              : std::chrono::microseconds(0));
+        }
+
+        if (outcome.ok() && range.length > 0 && outcome.http_status != 206) {
+            // The server ignored the Range header; retrying will not help.
+            outcome.code = CURLE_RANGE_ERROR;
+            outcome.error_class = ErrorClass::Client;
+            return outcome;
+        }
+        if (outcome.ok()) {
+            recordTransferStats(handle, winner_ctx.host);
+            learnRedirect(handle, url, winner_ctx);
+            recordAltSvc(handle, winner_ctx);
+            if (winner_output.commit()) {
+                outcome.error_class = ErrorClass::None;
+                break;
+            }
+            outcome.code = CURLE_WRITE_ERROR;
+        }
+        if (!winner_ctx.rejection.empty()) {
+            outcome.rejection = winner_ctx.rejection;
+            outcome.error_class = ErrorClass::Rejected;
+            counters.recordAttempt(outcome.error_class);
+            return outcome;
+        }
+
+        outcome.error_class = classifyError(outcome.code, outcome.http_status);
+        counters.recordAttempt(outcome.error_class);
+        const RetryPolicy policy = retryPolicyFor(outcome.error_class, options);
+        retries++;
+        if (retries >= policy.max_attempts) break;
+        logger.log("Retrying " + url + " after " + errorClassName(outcome.error_class) + " error (" +
+                   std::to_string(retries) + "/" + std::to_string(policy.max_attempts) + ")");
+        // The caller's host slot is given back for the backoff, which can be
+        // a long Retry-After, so other URLs for the host are not held up.
+        Tracer::Clock::time_point sleep_start = Tracer::Clock::now();
+        limiter.release(host);
+        std::this_thread::sleep_for(retryDelay(policy, retries, findHeader(winner_ctx.headers, "retry-after")));
+        limiter.acquire(host);
+        if constexpr (kTracingEnabled) {
+            Tracer::getInstance().span("retry_sleep", url, sleep_start, Tracer::Clock::now());
+        }
+    } while (true);
+
+    return outcome;
+}
+
+// total_urls is 0 when the input is a stream of unknown length.
+void reportCompleted(const std::string& url, size_t total_urls) {
+    int current_completed = ++g_completed_downloads;
+    std::string msg = "Downloaded " + std::to_string(current_completed);
+    if (total_urls > 0) {
+        double percentage = (static_cast<double>(current_completed) / total_urls) * 100;
+        msg += "/" + std::to_string(total_urls) + " (" + std::to_string(percentage) + "%)";
+    }
+    Logger::getInstance().log(msg + ": " + url);
+}
+
+struct DownloadResult {
+    std::string url;
+    std::string file;
+    bool ok = false;
+    long http_status = 0;
+    int attempts = 0;
+    std::string error;
+    std::chrono::steady_clock::time_point started;
+    ErrorClass error_class = ErrorClass::None;
+
+    // One-line JSON object (without the trailing newline); elapsed time runs
+    // up to the call.
+    std::string toJson() const {
+        std::error_code ec;
+        const uintmax_t bytes = ok ? std::filesystem::file_size(file, ec) : 0;
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started);
+        std::string line = "{\"url\":\"" + jsonEscape(url) + "\",\"ok\":" + (ok ? "true" : "false") +
+                           ",\"status\":" + std::to_string(http_status) +
+                           ",\"attempts\":" + std::to_string(attempts) +
+                           ",\"elapsed_ms\":" + std::to_string(elapsed.count());
+        if (ok) {
+            line += ",\"file\":\"" + jsonEscape(file) + "\",\"bytes\":" + std::to_string(ec ? 0 : bytes);
+        } else {
+            line += ",\"class\":\"" + std::string(errorClassName(error_class)) + "\",\"error\":\"" + jsonEscape(error) + "\"";
+        }
+        return line + "}";
+    }
+};
+
+// Emits one JSON object per finished URL on stdout, for consumers further
+// down a pipeline. Disabled unless streaming input or --json-results is used.
+class ResultWriter {
+public:
+    static ResultWriter& getInstance() {
+        static ResultWriter instance;
+        return instance;
+    }
+
+    ResultWriter(ResultWriter const&) = delete;
+    void operator=(ResultWriter const&) = delete;
+
+    void enable() { enabled_ = true; }
+    bool enabled() const { return enabled_; }
+
+    void write(const DownloadResult& result) {
+        if (!enabled_) return;
+        const std::string line = result.toJson() + "\n";
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::cout << line << std::flush;
+    }
+
+private:
+    ResultWriter() = default;
+    std::atomic<bool> enabled_{false};
+    std::mutex mtx_;
+};
+
+// Failed URLs as JSON lines (url, class, status, attempts, error, plus any
+// request details), in the input format parseInputLine() accepts, so the file
+// can be fed straight back with --retry-failed. Written to "<file>.part" and
+// renamed on close, so a run may retry from the same file it rewrites.
+class FailureLog {
+public:
+    static FailureLog& getInstance() {
+        static FailureLog instance;
+        return instance;
+    }
+
+    FailureLog(FailureLog const&) = delete;
+    void operator=(FailureLog const&) = delete;
+
+    bool open(const std::string& filename) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        filename_ = filename;
+        file_.open(filename + ".part", std::ios::trunc);
+        return static_cast<bool>(file_);
+    }
+
+    void record(const DownloadResult& result, const RequestSpec* request) {
+        if (!file_.is_open()) return;
+        std::string line = "{\"url\":\"" + jsonEscape(result.url) + "\",\"class\":\"" +
+                           errorClassName(result.error_class) + "\",\"status\":" + std::to_string(result.http_status) +
+                           ",\"attempts\":" + std::to_string(result.attempts) + ",\"error\":\"" + jsonEscape(result.error) + "\"";
+        if (request) {
+            if (!request->method.empty()) line += ",\"method\":\"" + jsonEscape(request->method) + "\"";
+            if (request->headers) {
+                line += ",\"headers\":[";
+                for (const curl_slist* header = request->headers; header; header = header->next) {
+                    line += (header == request->headers ? "\"" : ",\"") + jsonEscape(header->data) + "\"";
+                }
+                line += "]";
+            }
+            if (!request->cookies.empty()) line += ",\"cookies\":\"" + jsonEscape(request->cookies) + "\"";
+            if (request->body) line += ",\"body\":\"" + jsonEscape(*request->body) + "\"";
+        }
+        recordLine(line + "}");
+    }
+
+    // An already formatted failure, e.g. one --retry-failed does not re-run.
+    void recordLine(const std::string& line) {
+        if (!file_.is_open()) return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        file_ << line << '\n' << std::flush;
+        ++count_;
+    }
+
+    // Returns the number of failures written, or -1 if the file could not be finalized.
+    long close() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!file_.is_open()) return 0;
+        file_.close();
+        std::error_code ec;
+        std::filesystem::rename(filename_ + ".part", filename_, ec);
+        return ec ? -1 : static_cast<long>(count_);
+    }
+
+private:
+    FailureLog() = default;
+    std::mutex mtx_;
+    std::string filename_;
+    std::ofstream file_;
+    size_t count_ = 0;
+};
+
+// Every finished URL goes through here: JSON results on stdout (when
+// enabled) and the failures file.
+void publishResult(const DownloadResult& result, const RequestSpec* request) {
+    ResultWriter::getInstance().write(result);
+    if (!result.ok) FailureLog::getInstance().record(result, request);
+}
+
+DownloadResult downloadPage(const std::string& url, HostId host, const std::string& filename, size_t total_urls,
+                            const DownloadOptions& options, CurlHandle* reusable = nullptr,
+                            const RequestSpec* request = nullptr) {
+    Logger& logger = Logger::getInstance();
+    DownloadResult result{url, filename, false, 0, 0, {}, std::chrono::steady_clock::now()};
+    TransferOutcome outcome = transferToFile(url, host, filename, options, reusable, {}, request);
+    result.http_status = outcome.http_status;
+    result.attempts = outcome.attempts;
+    result.error_class = outcome.error_class;
+
+    if (!outcome.rejection.empty()) {
+        logger.log("Skipped " + url + ": " + outcome.rejection);
+        result.error = "rejected: " + outcome.rejection;
+    } else if (!outcome.ok()) {
+        logger.logError("Download failed for " + url + ": " + curl_easy_strerror(outcome.code));
+        result.error = curl_easy_strerror(outcome.code);
+    } else {
+        reportCompleted(url, total_urls);
+        result.ok = true;
+    }
+    if (!result.ok) ErrorCounters::getInstance().recordFailure(result.error_class);
+    publishResult(result, request);
+    return result;
+}
+template <class T> class Task;
+
+namespace detail {
+
+template <class T>
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation_ = std::noop_coroutine();
+    std::exception_ptr error_;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            return h.promise().continuation_;
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { error_ = std::current_exception(); }
+};
+
+template <class T>
+struct TaskPromise : TaskPromiseBase<T> {
+    std::optional<T> value_;
+    Task<T> get_return_object();
+    void return_value(T value) { value_ = std::move(value); }
+    T result() {
+        if (this->error_) std::rethrow_exception(this->error_);
+        return std::move(*value_);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase<void> {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() {
+        if (error_) std::rethrow_exception(error_);
+    }
+};
+
+} // namespace detail
+
+// Lazily started coroutine; the body runs when the Task is co_awaited and the
+// awaiting coroutine is resumed (via symmetric transfer) once it finishes.
+template <class T = void>
+class Task {
+public:
+    using promise_type = detail::TaskPromise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_) handle_.destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    ~Task() {
+        if (handle_) handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation_ = awaiting;
+        return handle_;
+    }
+    T await_resume() { return handle_.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+template <class T>
+Task<T> detail::TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+struct FetchResult {
+    CURLcode code = CURLE_OK;
+    long http_status = 0;
+    std::string effective_url;
+    std::string content_type;
+    std::string rejection;  // set when the response filter aborted the transfer
+    bool temporary_redirect = false;  // some hop in the redirect chain was not 301/308
+    HeaderList headers;
+    curl_off_t content_length = -1;
+    std::string body;
+    int proxy = -1;  // ProxyPool index used, if any
+    bool hedge_won = false;  // the duplicate of a hedged fetch finished first
+
+    bool ok() const { return code == CURLE_OK; }
+};
+
+// Single-threaded event loop over a curl_multi handle. Coroutines spawned on
+// the loop co_await fetch()/sleepFor() and are resumed from run() when their
+// transfer completes or their timer expires, so thousands of logical fetches
+// share one thread. Run one AsyncDownloader per thread; none of its members
+// are thread-safe.
+class AsyncDownloader {
+    struct Transfer;
+    struct Race;
+
+public:
+    explicit AsyncDownloader(const DownloadOptions& options) : options_(options), multi_(curl_multi_init()) {
+        if (!multi_) {
+            Logger::getInstance().logError("Error initializing CURL multi handle");
+        }
+    }
+    AsyncDownloader(const AsyncDownloader&) = delete;
+    AsyncDownloader& operator=(const AsyncDownloader&) = delete;
+
+    ~AsyncDownloader() {
+        FdBudget::getInstance().forget(this);
+        if (multi_) curl_multi_cleanup(multi_);
+    }
+
+    enum class FetchMode {
+        Body,         // GET, body to sink or FetchResult::body
+        Head,         // HEAD request
+        HeadersOnly,  // GET aborted after the final response's headers
+    };
+
+    class FetchAwaitable {
+    public:
+        FetchAwaitable(AsyncDownloader& loop, std::string url, HostId host, OutputFile* sink, FetchMode mode,
+                       const RequestSpec* request = nullptr, int avoid_proxy = -1, int attempt = 1)
+            : loop_(loop), transfer_(std::make_unique<Transfer>()) {
+            transfer_->url = std::move(url);
+            transfer_->context.host = host;
+            transfer_->sink = sink;
+            transfer_->mode = mode;
+            transfer_->context.request = request;
+            transfer_->avoid_proxy = avoid_proxy;
+            transfer_->context.attempt = attempt;
+        }
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> awaiting) {
+            transfer_->waiter = awaiting;
+            return loop_.start(*transfer_);
+        }
+        FetchResult await_resume() { return std::move(transfer_->result); }
+
+    private:
+        AsyncDownloader& loop_;
+        std::unique_ptr<Transfer> transfer_;
+    };
+
+    class HedgedFetchAwaitable {
+    public:
+        HedgedFetchAwaitable(AsyncDownloader& loop, std::string url, HostId host, OutputFile* sink,
+                             OutputFile* hedge_sink, std::chrono::microseconds delay, const RequestSpec* request,
+                             int avoid_proxy, int attempt)
+            : loop_(loop), race_(std::make_unique<Race>()) {
+            for (Transfer* transfer : {&race_->primary, &race_->hedge}) {
+                transfer->url = url;
+                transfer->context.host = host;
+                transfer->context.request = request;
+                transfer->context.attempt = attempt;
+                transfer->race = race_.get();
+            }
+            race_->primary.sink = sink;
+            race_->primary.avoid_proxy = avoid_proxy;
+            race_->hedge.sink = hedge_sink;
+            race_->hedge.fresh_connect = true;
+            race_->delay = delay;
+        }
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> awaiting) {
+            race_->waiter = awaiting;
+            return loop_.startRace(*race_);
+        }
+        FetchResult await_resume() {
+            FetchResult result = std::move(race_->hedge_won ? race_->hedge.result : race_->primary.result);
+            result.hedge_won = race_->hedge_won;
+            return result;
+        }
+
+    private:
+        AsyncDownloader& loop_;
+        std::unique_ptr<Race> race_;
+    };
+
+    class WakeAwaitable {
+    public:
+        explicit WakeAwaitable(AsyncDownloader& loop) : loop_(loop) {}
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> awaiting) { loop_.wake_waiters_.push_back(awaiting); }
+        void await_resume() const noexcept {}
+
+    private:
+        AsyncDownloader& loop_;
+    };
+
+    class SleepAwaitable {
+    public:
+        SleepAwaitable(AsyncDownloader& loop, std::chrono::milliseconds delay) : loop_(loop), delay_(delay) {}
+
+        bool await_ready() const noexcept { return delay_.count() <= 0; }
+        void await_suspend(std::coroutine_handle<> awaiting) {
+            loop_.timers_.emplace(std::chrono::steady_clock::now() + delay_, awaiting);
+        }
+        void await_resume() const noexcept {}
+
+    private:
+        AsyncDownloader& loop_;
+        std::chrono::milliseconds delay_;
+    };
+
+    // Body is collected into FetchResult::body, or streamed to sink when given;
+    // the caller commits or discards the sink afterwards. request, when given,
+    // must outlive the co_await. With a proxy pool, a retry passes the
+    // previous FetchResult::proxy as avoid_proxy, and its attempt number so
+    // adaptive timeouts can loosen. Callers that already hold url's HostId
+    // pass it to skip the HostTable lookup.
+    FetchAwaitable fetch(std::string url, HostId host, OutputFile* sink = nullptr, const RequestSpec* request = nullptr,
+                         int avoid_proxy = -1, int attempt = 1) {
+        return FetchAwaitable(*this, std::move(url), host, sink, FetchMode::Body, request, avoid_proxy, attempt);
+    }
+    FetchAwaitable fetch(std::string url, OutputFile* sink = nullptr, const RequestSpec* request = nullptr,
+                         int avoid_proxy = -1, int attempt = 1) {
+        const HostId host = hostIdOf(url);
+        return fetch(std::move(url), host, sink, request, avoid_proxy, attempt);
+    }
+
+    // Like fetch(), but once the request has waited delay without a response
+    // a duplicate goes out on a fresh connection (and another proxy) into
+    // hedge_sink. The first to succeed wins and the other is cancelled;
+    // FetchResult::hedge_won tells the caller which sink to commit.
+    HedgedFetchAwaitable hedgedFetch(std::string url, HostId host, OutputFile* sink, OutputFile* hedge_sink,
+                                     std::chrono::microseconds delay, const RequestSpec* request = nullptr,
+                                     int avoid_proxy = -1, int attempt = 1) {
+        return HedgedFetchAwaitable(*this, std::move(url), host, sink, hedge_sink, delay, request, avoid_proxy,
+                                    attempt);
+    }
+    HedgedFetchAwaitable hedgedFetch(std::string url, OutputFile* sink, OutputFile* hedge_sink,
+                                     std::chrono::microseconds delay, const RequestSpec* request = nullptr,
+                                     int avoid_proxy = -1, int attempt = 1) {
+        const HostId host = hostIdOf(url);
+        return hedgedFetch(std::move(url), host, sink, hedge_sink, delay, request, avoid_proxy, attempt);
+    }
+
+    // Headers of the final response only; the response filter is not applied.
+    FetchAwaitable probe(std::string url, HostId host, FetchMode mode = FetchMode::Head) {
+        return FetchAwaitable(*this, std::move(url), host, nullptr, mode);
+    }
+    FetchAwaitable probe(std::string url, FetchMode mode = FetchMode::Head) {
+        const HostId host = hostIdOf(url);
+        return probe(std::move(url), host, mode);
+    }
+
+    SleepAwaitable sleepFor(std::chrono::milliseconds delay) { return SleepAwaitable(*this, delay); }
+
+    // Parks the calling coroutine until the next wakeup(). One wakeup resumes
+    // every parked coroutine, so each re-checks what it was waiting for.
+    WakeAwaitable waitForWakeup() { return WakeAwaitable(*this); }
+
+    // Safe from any thread: interrupts the loop's poll so coroutines parked in
+    // waitForWakeup() resume on the loop's thread.
+    void wakeup() {
+        wake_requested_ = true;
+        if (multi_) curl_multi_wakeup(multi_);
+    }
+
+    // Starts the task immediately; run() keeps going until every spawned task finishes.
+    void spawn(Task<void> task) {
+        ++live_tasks_;
+        runDetached(this, std::move(task));
+    }
+
+    void run() {
+        while (live_tasks_ > 0) {
+            fireTimers();
+            resumeWoken();
+            if (live_tasks_ == 0) break;
+
+            startHedges();
+            resumePaused();
+            startWaiting();
+            int running = 0;
+            curl_multi_perform(multi_, &running);
+            resumeCompleted();
+            if (live_tasks_ == 0) break;
+
+            curl_multi_poll(multi_, nullptr, 0, pollTimeoutMs(), nullptr);
+        }
+    }
+
+    size_t inFlight() const { return in_flight_; }
+
+private:
+    struct Transfer {
+        std::string url;
+        OutputFile* sink = nullptr;
+        FetchMode mode = FetchMode::Body;
+        int avoid_proxy = -1;
+        bool fresh_connect = false;
+        bool host_slot = false;  // holds a HostLimiter slot for context.host
+        Race* race = nullptr;  // set for both legs of a hedged fetch
+        bool done = false;     // race legs only: finished or cancelled
+        TransferContext context;
+        Tracer::Clock::time_point started;
+        CurlHandle handle;
+        FetchResult result;
+        std::coroutine_handle<> waiter;
+    };
+
+    using HedgeDeadlines = std::multimap<std::chrono::steady_clock::time_point, Race*>;
+
+    struct Race {
+        Transfer primary;
+        Transfer hedge;
+        std::chrono::microseconds delay{0};
+        std::optional<HedgeDeadlines::iterator> deadline;  // until the hedge is started or ruled out
+        bool hedge_started = false;
+        bool hedge_won = false;
+        std::coroutine_handle<> waiter;
+    };
+
+    struct DetachedTask {
+        struct promise_type {
+            DetachedTask get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    static DetachedTask runDetached(AsyncDownloader* self, Task<void> task) {
+        try {
+            co_await std::move(task);
+        } catch (const std::exception& e) {
+            Logger::getInstance().logError(std::string("Unhandled exception in download task: ") + e.what());
+        }
+        --self->live_tasks_;
+    }
+
+    // Returns false (resume the awaiting coroutine immediately) when the
+    // transfer could not be started. A transfer that cannot get a HostLimiter
+    // slot or (with a proxy pool) a proxy yet waits in admission_wait_.
+    bool start(Transfer& transfer) {
+        if (!admit(transfer)) {
+            admission_wait_.push_back(&transfer);
+            return true;
+        }
+        return launch(transfer);
+    }
+
+    // Takes the host slot, then a proxy; a slot already taken is kept while
+    // the transfer waits for a proxy.
+    bool admit(Transfer& transfer) {
+        if (!transfer.host_slot) {
+            if (!HostLimiter::getInstance().tryAcquire(transfer.context.host)) return false;
+            transfer.host_slot = true;
+        }
+        ProxyPool& proxies = ProxyPool::getInstance();
+        if (proxies.enabled()) {
+            int proxy = proxies.tryAcquire(transfer.avoid_proxy);
+            if (proxy < 0) return false;
+            transfer.result.proxy = proxy;
+            transfer.context.proxy = proxies.url(proxy);
+        }
+        return true;
+    }
+
+    // Starts waiting transfers that can now be admitted; any that fail to
+    // start are resumed with the error.
+    void startWaiting() {
+        if (admission_wait_.empty()) return;
+        std::vector<Transfer*> waiting, failed;
+        waiting.swap(admission_wait_);
+        for (Transfer* transfer : waiting) {
+            if (!admit(*transfer)) {
+                admission_wait_.push_back(transfer);
+            } else if (!launch(*transfer)) {
+                failed.push_back(transfer);
+            }
+        }
+        std::vector<std::coroutine_handle<>> ready;
+        for (Transfer* transfer : failed) {
+            finish(*transfer, ready);
+        }
+        for (std::coroutine_handle<> waiter : ready) {
+            waiter.resume();
+        }
+    }
+
+    bool startRace(Race& race) {
+        if (!start(race.primary)) return false;
+        race.deadline = hedge_deadlines_.emplace(std::chrono::steady_clock::now() + race.delay, &race);
+        return true;
+    }
+
+    // Issues the duplicate of every race whose primary is still waiting for a
+    // response at its deadline.
+    void startHedges() {
+        const auto now = std::chrono::steady_clock::now();
+        std::vector<std::coroutine_handle<>> ready;
+        while (!hedge_deadlines_.empty() && hedge_deadlines_.begin()->first <= now) {
+            Race& race = *hedge_deadlines_.begin()->second;
+            hedge_deadlines_.erase(hedge_deadlines_.begin());
+            race.deadline.reset();
+            if (race.primary.context.response_status != 0) continue;
+            race.hedge_started = true;
+            race.hedge.avoid_proxy = race.primary.result.proxy;
+            if (!start(race.hedge)) finish(race.hedge, ready);
+        }
+        for (std::coroutine_handle<> waiter : ready) {
+            waiter.resume();
+        }
+    }
+
+    // Hands a finished transfer to its waiter; for a race leg, queues the race
+    // waiter once a leg succeeded or neither can anymore, cancelling the other.
+    void finish(Transfer& transfer, std::vector<std::coroutine_handle<>>& ready) {
+        Race* race = transfer.race;
+        if (!race) {
+            ready.push_back(transfer.waiter);
+            return;
+        }
+        transfer.done = true;
+        Transfer& other = &transfer == &race->primary ? race->hedge : race->primary;
+        const bool other_running = (&other == &race->primary || race->hedge_started) && !other.done;
+        if (!transfer.result.ok() && other_running) return;
+        if (other_running) cancel(other);
+        if (race->deadline) {
+            hedge_deadlines_.erase(*race->deadline);
+            race->deadline.reset();
+        }
+        race->hedge_won = &transfer == &race->hedge;
+        if (race->hedge_started) TtfbTracker::getInstance().noteHedge(race->hedge_won);
+        ready.push_back(race->waiter);
+    }
+
+    // Drops the losing leg of a race, whether still waiting for admission or running.
+    void cancel(Transfer& transfer) {
+        transfer.done = true;
+        auto waiting = std::find(admission_wait_.begin(), admission_wait_.end(), &transfer);
+        if (waiting != admission_wait_.end()) {
+            admission_wait_.erase(waiting);
+            releaseLeases(transfer, CURLE_OK);
+            return;
+        }
+        if (!transfer.handle) return;
+        CURL* handle = transfer.handle.get();
+        releaseLeases(transfer, CURLE_OK);  // cut short, not the proxy's fault
+        curl_multi_remove_handle(multi_, handle);
+        paused_.erase(std::remove(paused_.begin(), paused_.end(), handle), paused_.end());
+        transfer.handle = CurlHandle();
+        --in_flight_;
+    }
+
+    bool launch(Transfer& transfer) {
+        transfer.handle = CurlHandle(curl_easy_init());
+        if (!multi_ || !transfer.handle) {
+            transfer.result.code = CURLE_FAILED_INIT;
+            releaseLeases(transfer, CURLE_FAILED_INIT);
+            return false;
+        }
+        CURL* handle = transfer.handle.get();
+        transfer.context.output = transfer.sink;
+        transfer.context.may_block = false;
+        transfer.context.easy = handle;
+        transfer.context.pause_queue = &paused_;
+        transfer.context.body = &transfer.result.body;
+        transfer.context.filter = transfer.mode == FetchMode::Body ? &options_.filter : nullptr;
+        transfer.context.headers_only = transfer.mode == FetchMode::HeadersOnly;
+        configureTransfer(handle, transfer.url, transfer.context, options_);
+        if (transfer.mode == FetchMode::Head) curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+        if (transfer.fresh_connect) curl_easy_setopt(handle, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(handle, CURLOPT_PRIVATE, &transfer);
+        transfer.started = Tracer::Clock::now();
+        if (curl_multi_add_handle(multi_, handle) != CURLM_OK) {
+            transfer.result.code = CURLE_FAILED_INIT;
+            releaseLeases(transfer, CURLE_FAILED_INIT);
+            return false;
+        }
+        ++in_flight_;
+        return true;
+    }
+
+    void resumeCompleted() {
+        std::vector<Transfer*> completed;
+        int pending = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi_, &pending)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            Transfer* transfer = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char**>(&transfer));
+            transfer->result.code = msg->data.result;
+            completed.push_back(transfer);
+        }
+        // Resume only after draining and finishing every transfer: a resumed
+        // coroutine may add new handles, or free the race a completed leg belongs to.
+        std::vector<std::coroutine_handle<>> ready;
+        for (Transfer* transfer : completed) {
+            if (!transfer->handle) continue;  // the losing leg of a race decided in this batch
+            CURL* handle = transfer->handle.get();
+            curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &transfer->result.http_status);
+            char* effective_url = nullptr;
+            curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+            if (effective_url) transfer->result.effective_url = effective_url;
+            transfer->result.content_type = transfer->context.content_type;
+            transfer->result.rejection = transfer->context.rejection;
+            transfer->result.temporary_redirect = transfer->context.temporary_redirect;
+            transfer->result.headers = std::move(transfer->context.headers);
+            curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &transfer->result.content_length);
+            if (transfer->mode == FetchMode::HeadersOnly && transfer->result.code == CURLE_WRITE_ERROR &&
+                transfer->result.http_status >= 200 && transfer->result.http_status < 300) {
+                transfer->result.code = CURLE_OK;  // aborted on purpose after the headers
+            }
+            traceTransfer(handle, transfer->url, transfer->started, transfer->context);
+            if (transfer->mode == FetchMode::Body) {
+                recordAttemptOutcome(transfer->context.host, transfer->result.code, transfer->result.http_status,
+                                     transfer->result.headers);
+            }
+            if (transfer->result.ok()) {
+                learnRedirect(handle, transfer->url, transfer->context);
+                recordAltSvc(handle, transfer->context);
+                if (transfer->mode == FetchMode::Body) recordTransferStats(handle, transfer->context.host);
+            }
+            releaseLeases(*transfer, transfer->result.code);
+            curl_multi_remove_handle(multi_, handle);
+            paused_.erase(std::remove(paused_.begin(), paused_.end(), handle), paused_.end());
+            transfer->handle = CurlHandle();
+            --in_flight_;
+            finish(*transfer, ready);
+        }
+        for (std::coroutine_handle<> waiter : ready) {
+            waiter.resume();
+        }
+    }
+
+    // Gives back the transfer's HostLimiter slot and proxy lease, if held.
+    void releaseLeases(Transfer& transfer, CURLcode code) {
+        if (transfer.host_slot) {
+            HostLimiter::getInstance().release(transfer.context.host);
+            transfer.host_slot = false;
+        }
+        if (transfer.result.proxy < 0 || transfer.context.proxy.empty()) return;
+        const bool proxy_ok = code == CURLE_FAILED_INIT || !isProxyFailure(code, transfer.result.http_status);
+        std::chrono::microseconds ttfb = transfer.handle ? timeToFirstByte(transfer.handle.get()) : std::chrono::microseconds(0);
+        ProxyPool::getInstance().release(transfer.result.proxy, proxy_ok, ttfb);
+        transfer.context.proxy.clear();
+    }
+
+    void fireTimers() {
+        auto now = std::chrono::steady_clock::now();
+        while (!timers_.empty() && timers_.top().first <= now) {
+            std::coroutine_handle<> waiter = timers_.top().second;
+            timers_.pop();
+            waiter.resume();
+        }
+    }
+
+    // Transfers paused by a callback waiting on a shared budget are retried on
+    // every loop iteration; the callback pauses them again if still starved.
+    void resumeWoken() {
+        if (!wake_requested_.exchange(false)) return;
+        std::vector<std::coroutine_handle<>> woken;
+        woken.swap(wake_waiters_);
+        for (std::coroutine_handle<> waiter : woken) waiter.resume();
+    }
+
+    void resumePaused() {
+        if (paused_.empty()) return;
+        std::vector<CURL*> retry;
+        retry.swap(paused_);
+        for (CURL* handle : retry) {
+            curl_easy_pause(handle, CURLPAUSE_CONT);
+        }
+    }
+
+    // Without paused or waiting transfers nothing here needs polling: libcurl
+    // shortens the wait to its own timeouts and wakeup() interrupts it.
+    int pollTimeoutMs() const {
+        const int max_wait_ms = paused_.empty() && admission_wait_.empty() ? std::numeric_limits<int>::max() : 10;
+        std::optional<std::chrono::steady_clock::time_point> next;
+        if (!timers_.empty()) next = timers_.top().first;
+        if (!hedge_deadlines_.empty() && (!next || hedge_deadlines_.begin()->first < *next)) {
+            next = hedge_deadlines_.begin()->first;
+        }
+        if (!next) return max_wait_ms;
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(*next - std::chrono::steady_clock::now());
+        return static_cast<int>(std::clamp<long long>(wait.count(), 0, max_wait_ms));
+    }
+
+    using Timer = std::pair<std::chrono::steady_clock::time_point, std::coroutine_handle<>>;
+    struct TimerLater {
+        bool operator()(const Timer& a, const Timer& b) const { return a.first > b.first; }
+    };
+
+    const DownloadOptions& options_;
+    CURLM* multi_;
+    size_t in_flight_ = 0;
+    size_t live_tasks_ = 0;
+    std::priority_queue<Timer, std::vector<Timer>, TimerLater> timers_;
+    std::vector<CURL*> paused_;
+    std::vector<Transfer*> admission_wait_;
+    HedgeDeadlines hedge_deadlines_;
+    std::vector<std::coroutine_handle<>> wake_waiters_;
+    std::atomic<bool> wake_requested_{false};
+};
+
+// Coroutine counterpart of downloadPage(): same retry and progress semantics,
+// but waiting on the event loop instead of blocking a thread.
+Task<DownloadResult> downloadPageAsync(AsyncDownloader& loop, std::string url, HostId host, std::string filename,
+                                       size_t total_urls, const DownloadOptions& options,
+                                       RequestSpecPtr request = nullptr) {
+    Logger& logger = Logger::getInstance();
+    ErrorCounters& counters = ErrorCounters::getInstance();
+    int retries = 0;
+    FetchResult result;
+    DownloadResult record{url, filename, false, 0, 0, {}, std::chrono::steady_clock::now()};
+
+    do {
+        ++record.attempts;
+        OutputFile output(filename);
+        OutputFile hedge_output(filename, -1, ".hedge.part");  // created only if a hedge writes
+        const std::chrono::microseconds hedge_delay =
+            isHedgeable(request.get()) ? TtfbTracker::getInstance().hedgeDelay(host) : std::chrono::microseconds(0);
+        if (hedge_delay.count() > 0) {
+            result = co_await loop.hedgedFetch(url, host, &output, &hedge_output, hedge_delay, request.get(),
+                                               result.proxy, record.attempts);
+        } else {
+            result = co_await loop.fetch(url, host, &output, request.get(), result.proxy, record.attempts);
+        }
+        OutputFile& winner = result.hedge_won ? hedge_output : output;
+        if (result.ok()) {
+            // An empty body never opened the file; wait for a descriptor
+            // without blocking the loop.
+            while (winner.open(false) == OutputFile::OpenStatus::WouldBlock) {
+                FdBudget::getInstance().notifyOnRelease(&loop, [&loop] { loop.wakeup(); });
+                co_await loop.waitForWakeup();
+            }
+            if (winner.commit()) break;
+            result.code = CURLE_WRITE_ERROR;
+        }
+        if (!result.rejection.empty()) {
+            logger.log("Skipped " + url + ": " + result.rejection);
+            record.http_status = result.http_status;
+            record.error = "rejected: " + result.rejection;
+            record.error_class = ErrorClass::Rejected;
+            counters.recordAttempt(record.error_class);
+            counters.recordFailure(record.error_class);
+            publishResult(record, request.get());
+            co_return record;
+        }
+
+        record.error_class = classifyError(result.code, result.http_status);
+        counters.recordAttempt(record.error_class);
+        const RetryPolicy policy = retryPolicyFor(record.error_class, options);
+        retries++;
+        if (retries >= policy.max_attempts) break;
+        logger.log("Retrying " + url + " after " + errorClassName(record.error_class) + " error (" +
+                   std::to_string(retries) + "/" + std::to_string(policy.max_attempts) + ")");
+        Tracer::Clock::time_point sleep_start = Tracer::Clock::now();
+        co_await loop.sleepFor(retryDelay(policy, retries, findHeader(result.headers, "retry-after")));
+        if constexpr (kTracingEnabled) {
+            Tracer::getInstance().span("retry_sleep", url, sleep_start, Tracer::Clock::now());
+        }
+    } while (true);
+
+    record.http_status = result.http_status;
+    if (!result.ok()) {
+        logger.logError("Download failed for " + url + ": " + curl_easy_strerror(result.code));
+        record.error = curl_easy_strerror(result.code);
+        counters.recordFailure(record.error_class);
+    } else {
+        record.error_class = ErrorClass::None;
+        reportCompleted(url, total_urls);
+        record.ok = true;
+    }
+    publishResult(record, request.get());
+    co_return record;
+}
+
+// Trims the line in place and checks it looks like an http(s) URL.
+bool normalizeURL(std::string& url) {
+    static const std::regex urlRegex(R"(https?://[a-zA-Z0-9\-\.]+\.[a-zA-Z]{2,}(/[^\s]*)?)");
+    url.erase(0, url.find_first_not_of(" \t\n\r\f\v"));
+    url.erase(url.find_last_not_of(" \t\n\r\f\v") + 1);
+    return std::regex_match(url, urlRegex);
+}
+
+bool isHttpToken(std::string_view text) {
+    if (text.empty()) return false;
+    for (unsigned char c : text) {
+        if (!std::isalnum(c) && std::string_view("!#$%&'*+-.^_`|~").find(static_cast<char>(c)) == std::string_view::npos) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads the optional request fields of a JSON input line:
+//   {"url": "...", "method": "PUT", "headers": {"Name": "value"} or ["Name: value"],
+//    "cookies": "a=1; b=2" or {"a": "1"}, "body": "text" or any JSON value}
+// A non-string body is sent re-serialized, as application/json unless the
+// headers say otherwise. GET and HEAD lines may not have a body.
+bool parseRequestSpec(const JsonValue& line, RequestSpec& spec, std::string& error) {
+    using Type = JsonValue::Type;
+    if (const JsonValue* method = line.find("method")) {
+        if (method->type != Type::String || !isHttpToken(method->text)) {
+            error = "method must be an HTTP token";
+            return false;
+        }
+        for (char c : method->text) spec.method += static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    }
+
+    std::vector<std::string> header_lines;
+    bool has_content_type = false;
+    auto add_header = [&](std::string_view name, std::string_view value) {
+        if (!isHttpToken(name) || value.find_first_of("\r\n") != std::string_view::npos) {
+            error = "invalid header: " + std::string(name);
+            return false;
+        }
+        if (toLower(std::string(name)) == "content-type") has_content_type = true;
+        header_lines.push_back(std::string(name) + ": " + std::string(value));
+        return true;
+    };
+    if (const JsonValue* headers = line.find("headers")) {
+        if (headers->type == Type::Object) {
+            for (const auto& [name, value] : headers->members) {
+                if (value.type != Type::String) {
+                    error = "header values must be strings";
+                    return false;
+                }
+                if (!add_header(name, value.text)) return false;
+            }
+        } else if (headers->type == Type::Array) {
+            for (const JsonValue& item : headers->items) {
+                size_t colon = item.type == Type::String ? item.text.find(':') : std::string::npos;
+                if (colon == std::string::npos) {
+                    error = "header lines must be \"Name: value\" strings";
+                    return false;
+                }
+                std::string_view text(item.text);
+                if (!add_header(trim(text.substr(0, colon)), trim(text.substr(colon + 1)))) return false;
+            }
+        } else {
+            error = "headers must be an object or an array";
+            return false;
+        }
+    }
+
+    if (const JsonValue* cookies = line.find("cookies")) {
+        if (cookies->type == Type::String) {
+            spec.cookies = cookies->text;
+        } else if (cookies->type == Type::Object) {
+            for (const auto& [name, value] : cookies->members) {
+                if (value.type != Type::String) {
+                    error = "cookie values must be strings";
+                    return false;
+                }
+                spec.cookies += (spec.cookies.empty() ? "" : "; ") + name + "=" + value.text;
+            }
+        } else {
+            error = "cookies must be a string or an object";
+            return false;
+        }
+        if (spec.cookies.find_first_of("\r\n") != std::string::npos) {
+            error = "invalid cookies";
+            return false;
+        }
+    }
+
+    if (const JsonValue* body = line.find("body")) {
+        if (body->type == Type::String) {
+            spec.body = body->text;
+        } else if (body->type != Type::Null) {
+            spec.body = body->serialize();
+            if (!has_content_type) header_lines.push_back("Content-Type: application/json");
+        }
+    }
+    if (spec.body && (spec.method == "GET" || spec.method == "HEAD")) {
+        error = spec.method + " requests cannot carry a body";
+        return false;
+    }
+    spec.headers = HeaderListCache::getInstance().intern(header_lines);
+    return true;
+}
+
+// One input line: a bare URL, or a JSON object with "url" and optional
+// request fields. request stays null for a plain GET.
+bool parseInputLine(std::string& line, RequestSpecPtr& request, std::string& error) {
+    request = nullptr;
+    std::string_view content = trim(line);
+    if (content.empty() || content.front() != '{') {
+        if (normalizeURL(line)) return true;
+        error = "invalid URL";
+        return false;
+    }
+
+    JsonValue parsed;
+    if (!JsonParser::parse(content, parsed, error)) return false;
+    const JsonValue* url = parsed.find("url");
+    if (parsed.type != JsonValue::Type::Object || !url || url->type != JsonValue::Type::String) {
+        error = "missing \"url\"";
+        return false;
+    }
+    std::string url_text = url->text;
+    if (!normalizeURL(url_text)) {
+        error = "invalid URL";
+        return false;
+    }
+    auto spec = std::make_shared<RequestSpec>();
+    if (!parseRequestSpec(parsed, *spec, error)) return false;
+    line = std::move(url_text);
+    if (!spec->method.empty() || spec->headers || !spec->cookies.empty() || spec->body) request = std::move(spec);
+    return true;
+}
+
+// A batch's URL list packed into one arena: URL bytes are appended to 1 MiB
+// chunks (so views stay valid as the table grows) and indexed by one 16-byte
+// entry per URL, holding its location and host id, instead of a 32-byte
+// std::string plus a heap block each.
+// Tasks carry a UrlTable::Id instead of a copy of the URL.
+class UrlTable {
+public:
+    using Id = uint32_t;
+
+    UrlTable() = default;
+    UrlTable(UrlTable&&) = default;
+    UrlTable& operator=(UrlTable&&) = default;
+    UrlTable(const UrlTable&) = delete;
+    UrlTable& operator=(const UrlTable&) = delete;
+
+    Id add(std::string_view url) {
+        if (chunks_.empty() || url.size() > kChunkBytes - used_) {
+            // An oversized URL gets a chunk of its own, which is then full.
+            chunks_.push_back(std::make_unique<char[]>(std::max(url.size(), kChunkBytes)));
+            used_ = 0;
+        }
+        std::memcpy(chunks_.back().get() + used_, url.data(), url.size());
+        entries_.push_back({static_cast<uint32_t>(chunks_.size() - 1), static_cast<uint32_t>(used_),
+                            static_cast<uint32_t>(url.size()), hostIdOf(url)});
+        used_ = url.size() > kChunkBytes ? kChunkBytes : used_ + url.size();
+        return static_cast<Id>(entries_.size() - 1);
+    }
+
+    std::string_view operator[](Id id) const {
+        const Entry& entry = entries_[id];
+        return std::string_view(chunks_[entry.chunk].get() + entry.offset, entry.length);
+    }
+
+    HostId host(Id id) const { return entries_[id].host; }
+
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+    size_t memoryBytes() const { return chunks_.size() * kChunkBytes + entries_.capacity() * sizeof(Entry); }
+
+private:
+    struct Entry {
+        uint32_t chunk;
+        uint32_t offset;
+        uint32_t length;
+        HostId host;  // interned at load time
+    };
+
+    static constexpr size_t kChunkBytes = size_t{1} << 20;
+
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    size_t used_ = kChunkBytes;  // bytes used in chunks_.back(); full until the first add()
+    std::vector<Entry> entries_;
+};
+
+// The URL to fetch for an input entry: its cached redirect target, if any.
+// host gets the entry's load-time id, or the target's when it was rewritten.
+std::string fetchUrl(const UrlTable& urls, UrlTable::Id id, HostId& host) {
+    std::string url = RedirectCache::getInstance().resolve(std::string(urls[id]));
+    host = url == urls[id] ? urls.host(id) : hostIdOf(url);
+    return url;
+}
+
+// requests, when given, receives each URL's request details (null for plain
+// GETs), index-aligned with the returned URLs; it stays empty when no line
+// carries a custom request. only_classes, when given, keeps just the
+// failures-file lines whose "class" is listed; the others are carried over to
+// the new failures file unchanged.
+UrlTable loadURLs(const std::string& filename, std::vector<RequestSpecPtr>* requests = nullptr,
+                  const std::vector<ErrorClass>* only_classes = nullptr) {
+    Logger& logger = Logger::getInstance();
+    UrlTable urls;
+    std::ifstream file(filename);
+    if (!file) {
+        logger.logError("Error opening file: " + filename);
+        return urls;
+    }
+    std::string line, error;
+    size_t filtered = 0;
+    while (std::getline(file, line)) {
+        if (only_classes && trim(line).substr(0, 1) == "{") {
+            JsonValue parsed;
+            const JsonValue* error_class = JsonParser::parse(line, parsed, error) ? parsed.find("class") : nullptr;
+            std::optional<ErrorClass> parsed_class =
+                error_class && error_class->type == JsonValue::Type::String ? errorClassFromName(error_class->text) : std::nullopt;
+            if (parsed_class && std::find(only_classes->begin(), only_classes->end(), *parsed_class) == only_classes->end()) {
+                ++filtered;
+                FailureLog::getInstance().recordLine(std::string(trim(line)));
+                continue;
+            }
+        }
+        RequestSpecPtr request;
+        if (parseInputLine(line, request, error)) {
+            UrlTable::Id id = urls.add(line);
+            if (requests && request) {
+                requests->resize(id);
+                requests->push_back(std::move(request));
+            }
+        } else if (!trim(line).empty()) {
+            logger.log("Invalid input line skipped (" + error + "): " + line);
+        }
+    }
+    if (filtered > 0) {
+        logger.log("Not retrying " + std::to_string(filtered) + " failures outside the selected error classes.");
+    }
+    if (requests && !requests->empty()) requests->resize(urls.size());
+    return urls;
+}
+
+struct ProbeResult {
+    bool ok = false;
+    long http_status = 0;
+    std::string final_url;
+    curl_off_t content_length = -1;
+    std::string content_type;
+    bool accepts_ranges = false;
+};
+
+// HEAD every URL on one event loop at options.probe.concurrency. Servers that
+// refuse HEAD get a GET that is aborted as soon as the headers arrive. URLs
+// with their own request details are not probed (a plain HEAD says nothing
+// about them); their results stay !ok. final_url follows only permanent
+// redirects; a chain with a temporary hop keeps the original URL.
+std::vector<ProbeResult> probeAll(const UrlTable& urls, const DownloadOptions& options,
+                                  const std::vector<RequestSpecPtr>& requests = {}) {
+    std::vector<ProbeResult> results(urls.size());
+    AsyncDownloader loop(options);
+    size_t next_index = 0;
+
+    auto worker = [&]() -> Task<void> {
+        while (next_index < urls.size()) {
+            const UrlTable::Id i = static_cast<UrlTable::Id>(next_index++);
+            if (i < requests.size() && requests[i]) continue;
+            HostId host = HostTable::kNoHost;
+            const std::string url = fetchUrl(urls, i, host);
+            FetchResult fetched = co_await loop.probe(url, host);
+            if (!fetched.ok() && (fetched.http_status == 403 || fetched.http_status == 405 ||
+                                  fetched.http_status == 501)) {
+                fetched = co_await loop.probe(url, host, AsyncDownloader::FetchMode::HeadersOnly);
+            }
+            ProbeResult& result = results[i];
+            result.ok = fetched.ok();
+            result.http_status = fetched.http_status;
+            result.final_url = fetched.effective_url.empty() || fetched.temporary_redirect ? url : fetched.effective_url;
+            result.content_length = fetched.content_length;
+            result.content_type = fetched.content_type;
+            result.accepts_ranges = toLower(std::string(findHeader(fetched.headers, "accept-ranges"))) == "bytes";
+        }
+    };
+
+    for (size_t k = 0; k < std::min(std::max<size_t>(1, options.probe.concurrency), urls.size()); ++k) {
+        loop.spawn(worker());
+    }
+    loop.run();
+    return results;
+}
+
+struct PlannedDownload {
+    UrlTable::Id index = 0;  // position in the input list; names the output file
+    std::string url;   // redirect target when the probe found one
+    HostId host = HostTable::kNoHost;  // url's
+    curl_off_t size = -1;
+};
+
+struct DownloadPlan {
+    std::vector<PlannedDownload> segmented;
+    std::vector<PlannedDownload> singles;
+    std::vector<std::vector<PlannedDownload>> batches;  // small objects grouped by host
+    size_t redirects_collapsed = 0;
+    size_t skipped = 0;
+};
+
+DownloadPlan planDownloads(const UrlTable& urls, const std::vector<ProbeResult>& probes,
+                           const DownloadOptions& options) {
+    Logger& logger = Logger::getInstance();
+    const ProbeOptions& probe = options.probe;
+    const ResponseFilter& filter = options.filter;
+    DownloadPlan plan;
+    std::vector<HostId> batch_hosts;
+
+    for (UrlTable::Id i = 0; i < urls.size(); ++i) {
+        const ProbeResult& result = probes[i];
+        PlannedDownload item{i, {}, HostTable::kNoHost, -1};
+        item.url = fetchUrl(urls, i, item.host);
+        if (!result.ok) {
+            // A failed probe is not authoritative; let the real download decide.
+            plan.singles.push_back(item);
+            continue;
+        }
+        std::string rejection;
+        if (!filter.allowsContentType(result.content_type)) {
+            rejection = "content type " + result.content_type + " not allowed";
+        } else if (filter.max_content_length > 0 && result.content_length > filter.max_content_length) {
+            rejection = "content length " + std::to_string(result.content_length) + " exceeds " +
+                        std::to_string(filter.max_content_length);
+        } else if (filter.max_body_bytes > 0 && result.content_length > static_cast<curl_off_t>(filter.max_body_bytes)) {
+            rejection = "body exceeds " + std::to_string(filter.max_body_bytes) + " bytes";
+        }
+        if (!rejection.empty()) {
+            // Reported like a rejection during the download itself.
+            logger.log("Skipped " + item.url + ": rejected by probe (" + rejection + ")");
+            DownloadResult rejected{item.url, {}, false, result.http_status, 1, "rejected: " + rejection,
+                                    std::chrono::steady_clock::now(), ErrorClass::Rejected};
+            ErrorCounters::getInstance().recordAttempt(ErrorClass::Rejected);
+            ErrorCounters::getInstance().recordFailure(ErrorClass::Rejected);
+            publishResult(rejected, nullptr);
+            ++plan.skipped;
+            continue;
+        }
+        if (result.final_url != item.url) {
+            item.url = result.final_url;
+            item.host = hostIdOf(item.url);
+            ++plan.redirects_collapsed;
+        }
+        item.size = result.content_length;
+
+        if (result.accepts_ranges && probe.max_segments > 1 && item.size >= probe.segment_threshold) {
+            plan.segmented.push_back(item);
+        } else if (item.size >= 0 && item.size <= probe.small_object_bytes && probe.small_batch_size > 1) {
+            auto it = std::find(batch_hosts.begin(), batch_hosts.end(), item.host);
+            size_t slot = static_cast<size_t>(it - batch_hosts.begin());
+            if (it == batch_hosts.end() || plan.batches[slot].size() >= probe.small_batch_size) {
+                // Retire a full batch's slot so the host opens a fresh batch.
+                if (it != batch_hosts.end()) *it = HostTable::kNoHost;
+                batch_hosts.push_back(item.host);
+                plan.batches.emplace_back();
+                slot = plan.batches.size() - 1;
+            }
+            plan.batches[slot].push_back(item);
+        } else {
+            plan.singles.push_back(item);
+        }
+    }
+    return plan;
+}
+
+// Splits one range-capable object into parallel ranged GETs writing into a
+// pre-sized "<filename>.part", renamed into place once every segment is in.
+// If any segment fails, the last one to finish falls back to a plain
+// whole-file download.
+void downloadSegmented(ThreadPool& pool, const PlannedDownload& item, const std::string& filename, size_t total_urls,
+                       const DownloadOptions& options) {
+    Logger& logger = Logger::getInstance();
+    const std::string part = filename + ".part";
+    const auto started = std::chrono::steady_clock::now();
+    std::error_code ec;
+    { std::ofstream create(part, std::ios::binary | std::ios::trunc); }
+    std::filesystem::resize_file(part, static_cast<std::uintmax_t>(item.size), ec);
+    if (ec) {
+        std::remove(part.c_str());
+        logger.logError("Error sizing file " + part + ": " + ec.message());
+        enqueueWithHostSlot(pool, item.host, [item, filename, total_urls, &options]() {
+            downloadPage(item.url, item.host, filename, total_urls, options);
+        });
+        return;
+    }
+
+    struct SegmentedJob {
+        std::atomic<size_t> remaining{0};
+        std::atomic<bool> failed{false};
+    };
+    const size_t segments = options.probe.max_segments;
+    const curl_off_t segment_length = (item.size + static_cast<curl_off_t>(segments) - 1) / segments;
+    auto job = std::make_shared<SegmentedJob>();
+    job->remaining = segments;
+
+    for (size_t s = 0; s < segments; ++s) {
+        ByteRange range{static_cast<curl_off_t>(s) * segment_length, 0};
+        range.length = std::min(segment_length, item.size - range.offset);
+        enqueueWithHostSlot(pool, item.host, [item, filename, part, total_urls, range, job, started, &options]() {
+            if (range.length > 0 && !transferToFile(item.url, item.host, part, options, nullptr, range).ok()) {
+                job->failed = true;
+            }
+            if (--job->remaining > 0) return;
+            if (!job->failed && std::rename(part.c_str(), filename.c_str()) != 0) job->failed = true;
+            if (job->failed) {
+                std::remove(part.c_str());
+                Logger::getInstance().log("Segmented download failed for " + item.url + ", retrying as one transfer");
+                downloadPage(item.url, item.host, filename, total_urls, options);
+            } else {
+                reportCompleted(item.url, total_urls);
+                publishResult({item.url, filename, true, 206, 1, {}, started}, nullptr);
+            }
+        });
     }
-    std::string url;
-    std::regex urlRegex(R"(https?://[a-zA-Z0-9\-\.]+\.[a-zA-Z]{2,}(/[^\s]*)?)");
-    while (std::getline(file, url)) {
-        url.erase(0, url.find_first_not_of(" \t\n\r\f\v"));
-        url.erase(url.find_last_not_of(" \t\n\r\f\v") + 1);
-        if (std::regex_match(url, urlRegex)) {
-            urls.push_back(url);
-        } else {
-            logger.log("Invalid URL skipped: " + url);
+}
+
+std::string formatPoolStats(const ThreadPool::Stats& stats) {
+    uint64_t executed = 0;
+    for (const ThreadPool::WorkerStats& worker : stats.workers) executed += worker.tasks_executed;
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1)
+        << "Pool: " << stats.active_workers << "/" << stats.workers.size() << " workers busy, "
+        << stats.queue_length << " queued, " << executed << "/" << stats.tasks_enqueued << " tasks done, "
+        << "utilization " << stats.utilization() * 100 << "%, queue wait p50<="
+        << stats.queueWaitPercentile(50).count() / 1000.0 << "ms p99<="
+        << stats.queueWaitPercentile(99).count() / 1000.0 << "ms";
+    return out.str();
+}
+
+uint64_t fnv1a(std::string_view text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string sanitizeFileName(std::string_view text, size_t max_length) {
+    std::string name;
+    for (char c : text.substr(0, max_length)) {
+        name += (std::isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '-') ? c : '_';
+    }
+    return name;
+}
+
+// Output path of the URL at (1-based) position ordinal in the input.
+std::filesystem::path outputPathFor(std::string_view url_text, size_t ordinal, const OutputOptions& output) {
+    const uint64_t hash = fnv1a(url_text);
+    std::filesystem::path dir(output.directory);
+    if (output.layout == OutputOptions::Layout::HashSharded) {
+        for (size_t level = 0; level < output.shard_levels && level < 8; ++level) {
+            char shard[3];
+            std::snprintf(shard, sizeof(shard), "%02x", static_cast<unsigned>((hash >> (8 * level)) & 0xff));
+            dir /= shard;
         }
+    } else if (output.layout == OutputOptions::Layout::ByHost) {
+        dir /= sanitizeFileName(hostOf(url_text), 255);
     }
-    return urls;
+
+    if (output.url_names) {
+        std::string_view url(url_text);
+        size_t scheme = url.find("://");
+        if (scheme != std::string_view::npos) url.remove_prefix(scheme + 3);
+        char suffix[10];
+        std::snprintf(suffix, sizeof(suffix), "-%08x", static_cast<unsigned>(hash & 0xffffffff));
+        return dir / (sanitizeFileName(url, 120) + suffix + ".html");
+    }
+    return dir / ("page" + std::to_string(ordinal) + ".html");
+}
+
+// Creates each distinct output directory the first time a path needs it (so
+// workers never touch the directory tree) and writes the URL-to-path index.
+// Paths are not kept: tasks recompute theirs from the URL id with
+// outputPathString().
+void prepareOutputs(const UrlTable& urls, const OutputOptions& output) {
+    Logger& logger = Logger::getInstance();
+    const std::filesystem::path root(output.directory);
+    std::unordered_set<std::string> created;
+    auto create = [&](const std::filesystem::path& dir) {
+        if (!created.insert(dir.string()).second) return;
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec) logger.logError("Error creating directory " + dir.string() + ": " + ec.message());
+    };
+    create(root);
+    std::ofstream index;
+    if (!output.index_file.empty()) index.open(root / output.index_file, std::ios::trunc);
+
+    for (UrlTable::Id i = 0; i < urls.size(); ++i) {
+        std::filesystem::path path = outputPathFor(urls[i], static_cast<size_t>(i) + 1, output);
+        create(path.parent_path());
+        if (index.is_open()) index << urls[i] << '\t' << path.string() << '\n';
+    }
+    if (index.is_open() && !index) logger.logError("Error writing index file: " + (root / output.index_file).string());
+}
+
+std::string outputPathString(const UrlTable& urls, UrlTable::Id id, const OutputOptions& output) {
+    return outputPathFor(urls[id], static_cast<size_t>(id) + 1, output).string();
+}
+
+// Expected duration of a transfer from the host profiles; size is -1 when
+// unknown. Hosts without history count as typical_ms, a typical known host.
+double expectedDuration(HostId host, curl_off_t size, double typical_ms) {
+    return HostProfiles::getInstance().expectedMs(host, size, typical_ms);
+}
+
+// Longest-expected-first (LPT) order, so a slow host near the end of the
+// list cannot stretch the run while the other workers sit idle. Ties keep
+// their input order, which makes a run without history plain FIFO.
+std::vector<UrlTable::Id> longestFirstOrder(const std::vector<double>& expected_ms) {
+    std::vector<UrlTable::Id> order(expected_ms.size());
+    for (UrlTable::Id i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](UrlTable::Id a, UrlTable::Id b) { return expected_ms[a] > expected_ms[b]; });
+    return order;
+}
+
+std::vector<UrlTable::Id> dispatchOrder(const UrlTable& urls, const DownloadOptions& options) {
+    if (options.schedule == DownloadOptions::Schedule::LongestFirst && HostProfiles::getInstance().enabled()) {
+        const double typical_ms = HostProfiles::getInstance().typicalMs();
+        std::vector<double> expected;
+        expected.reserve(urls.size());
+        for (UrlTable::Id i = 0; i < urls.size(); ++i) expected.push_back(expectedDuration(urls.host(i), -1, typical_ms));
+        return longestFirstOrder(expected);
+    }
+    std::vector<UrlTable::Id> order(urls.size());
+    for (UrlTable::Id i = 0; i < order.size(); ++i) order[i] = i;
+    return order;
 }
 
-void downloadAll(const std::vector<std::string>& urls) {
+void logRedirectCacheUse() {
+    if (size_t rewritten = RedirectCache::getInstance().rewritten()) {
+        Logger::getInstance().log("Redirect cache rewrote " + std::to_string(rewritten) + " URLs.");
+    }
+}
+
+// requests is empty or index-aligned with urls (see loadURLs()).
+void downloadAll(const UrlTable& urls, const DownloadOptions& options, const std::vector<RequestSpecPtr>& requests = {}) {
     Logger& logger = Logger::getInstance();
-    const size_t NUM_THREADS = std::min(std::max(4U, static_cast<unsigned int>(urls.size() / 5)), std::thread::hardware_concurrency() * 2);
+    prepareOutputs(urls, options.output);
+    const size_t NUM_THREADS = options.threads > 0 ? options.threads : std::min(std::max(4U, static_cast<unsigned int>(urls.size() / 5)), std::thread::hardware_concurrency() * 2);
     logger.log("Starting download with " + std::to_string(NUM_THREADS) + " threads.");
 
-    ThreadPool pool(NUM_THREADS);
+    std::vector<int> cpus;
+    if (options.pin_workers) {
+        CpuTopology topology = CpuTopology::detect();
+        cpus = topology.cpus;
+        logger.log("Pinning workers across " + std::to_string(cpus.size()) + " CPUs on " +
+                   std::to_string(topology.num_nodes) + " NUMA nodes.");
+    }
+    ThreadPool pool(NUM_THREADS, cpus);
+    // State shared by every single-URL task, so a queued task is just a
+    // pointer and an id and fits std::function's inline storage. The URL, its
+    // redirect target and its output path are materialized when a worker
+    // picks the task up.
+    struct SingleDownloads {
+        ThreadPool& pool;
+        const UrlTable& urls;
+        const std::vector<RequestSpecPtr>& requests;
+        const DownloadOptions& options;
+        std::unordered_map<UrlTable::Id, PlannedDownload> probed;  // entries the probe redirected; read-only once dispatch starts
+
+        void run(UrlTable::Id id) const {
+            auto redirected = probed.find(id);
+            HostId host = HostTable::kNoHost;
+            std::string url;
+            if (redirected == probed.end()) {
+                url = fetchUrl(urls, id, host);
+            } else {
+                url = redirected->second.url;
+                host = redirected->second.host;
+            }
+            if constexpr (kTracingEnabled) {
+                Tracer::getInstance().span("queue_wait", url, ThreadPool::currentTaskEnqueued(), Tracer::Clock::now());
+            }
+            runWithHostSlot(pool, host, [this, id, host, url = std::move(url)]() {
+                downloadPage(url, host, outputPathString(urls, id, options.output), urls.size(), options, nullptr,
+                             id < requests.size() ? requests[id].get() : nullptr);
+            });
+        }
+    } singles{pool, urls, requests, options, {}};
+    auto enqueue_single = [&](UrlTable::Id id) {
+        pool.enqueue([shared = &singles, id]() { shared->run(id); });
+    };
+
+    if (options.probe.enabled) {
+        logger.log("Probing " + std::to_string(urls.size()) + " URLs...");
+        DownloadPlan plan = planDownloads(urls, probeAll(urls, options, requests), options);
+        logger.log("Plan: " + std::to_string(plan.segmented.size()) + " segmented, " +
+                   std::to_string(plan.singles.size()) + " single, " + std::to_string(plan.batches.size()) +
+                   " small-object batches, " + std::to_string(plan.redirects_collapsed) + " redirects collapsed, " +
+                   std::to_string(plan.skipped) + " skipped.");
+
+        // Longest work first so large objects do not trail the batch.
+        if (options.schedule == DownloadOptions::Schedule::LongestFirst && HostProfiles::getInstance().enabled()) {
+            const double typical_ms = HostProfiles::getInstance().typicalMs();
+            std::vector<double> single_ms;
+            for (const PlannedDownload& item : plan.singles) {
+                single_ms.push_back(expectedDuration(item.host, item.size, typical_ms));
+            }
+            std::vector<PlannedDownload> singles;
+            for (UrlTable::Id k : longestFirstOrder(single_ms)) {
+                singles.push_back(std::move(plan.singles[k]));
+            }
+            plan.singles = std::move(singles);
+
+            std::vector<double> batch_ms;
+            for (const std::vector<PlannedDownload>& batch : plan.batches) {
+                double total_ms = 0;
+                for (const PlannedDownload& item : batch) total_ms += expectedDuration(item.host, item.size, typical_ms);
+                batch_ms.push_back(total_ms);
+            }
+            std::vector<std::vector<PlannedDownload>> batches;
+            for (UrlTable::Id k : longestFirstOrder(batch_ms)) {
+                batches.push_back(std::move(plan.batches[k]));
+            }
+            plan.batches = std::move(batches);
+        }
+        for (const PlannedDownload& item : plan.segmented) {
+            downloadSegmented(pool, item, outputPathString(urls, item.index, options.output), urls.size(), options);
+        }
+        for (PlannedDownload& item : plan.singles) {
+            if (item.url != urls[item.index]) singles.probed.emplace(item.index, std::move(item));
+        }
+        for (const PlannedDownload& item : plan.singles) {
+            enqueue_single(item.index);
+        }
+        for (std::vector<PlannedDownload>& batch : plan.batches) {
+            const HostId host = batch.front().host;
+            enqueueWithHostSlot(pool, host, [batch = std::move(batch), &urls, &options]() {
+                CurlHandle connection;  // reused so the batch shares one keep-alive connection
+                for (const PlannedDownload& item : batch) {
+                    downloadPage(item.url, item.host, outputPathString(urls, item.index, options.output), urls.size(),
+                                 options, &connection);
+                }
+            });
+        }
+    } else {
+        for (UrlTable::Id id : dispatchOrder(urls, options)) {
+            enqueue_single(id);
+        }
+    }
+
+    while (!pool.waitForIdle(options.stats_interval)) {
+        logger.log(formatPoolStats(pool.stats()));
+    }
+    logger.log(formatPoolStats(pool.stats()));
+    logRedirectCacheUse();
+}
+
+// Event-loop engine: a few threads, each running an AsyncDownloader with up
+// to options.max_in_flight concurrent transfers pulled from a shared index. With
+// options.pin_workers, options.event_loops is ignored and one loop is pinned to every usable CPU;
+// each loop builds its curl state and write buffers after pinning so they are
+// allocated on its own NUMA node.
+void downloadAllAsync(const UrlTable& urls, const DownloadOptions& options,
+                      const std::vector<RequestSpecPtr>& requests = {}) {
+    Logger& logger = Logger::getInstance();
+    prepareOutputs(urls, options.output);
+    size_t num_loops = options.event_loops;
+    size_t max_in_flight = options.max_in_flight;
+    std::vector<int> cpus;
+    if (options.pin_workers) {
+        CpuTopology topology = CpuTopology::detect();
+        cpus = topology.cpus;
+        num_loops = cpus.size();
+        logger.log("Pinning one event loop per CPU across " + std::to_string(topology.num_nodes) + " NUMA nodes.");
+    }
+    num_loops = std::max<size_t>(1, num_loops);
+    max_in_flight = std::max<size_t>(1, max_in_flight);
+    logger.log("Starting async download with " + std::to_string(num_loops) + " event loops, " +
+               std::to_string(max_in_flight) + " transfers each.");
+
+    const std::vector<UrlTable::Id> order = dispatchOrder(urls, options);
+    std::atomic<size_t> next_index(0);
+    // The whole order is queued at once, so this is every task's enqueue time.
+    const Tracer::Clock::time_point enqueued = Tracer::Clock::now();
+    auto worker = [&](AsyncDownloader& loop) -> Task<void> {
+        for (size_t next = next_index++; next < order.size(); next = next_index++) {
+            const UrlTable::Id i = order[next];
+            HostId host = HostTable::kNoHost;
+            std::string url = fetchUrl(urls, i, host);
+            std::string path = outputPathString(urls, i, options.output);
+            RequestSpecPtr request = i < requests.size() ? requests[i] : nullptr;
+            if constexpr (kTracingEnabled) {
+                Tracer::getInstance().span("queue_wait", url, enqueued, Tracer::Clock::now());
+            }
+            co_await downloadPageAsync(loop, std::move(url), host, std::move(path), urls.size(), options, std::move(request));
+        }
+    };
+
+    std::vector<std::thread> loops;
+    for (size_t t = 0; t < num_loops; ++t) {
+        int cpu = cpus.empty() ? -1 : cpus[t];
+        loops.emplace_back([&, cpu] {
+            if (cpu >= 0 && !pinCurrentThread(cpu)) {
+                logger.logError("Could not pin event loop to CPU " + std::to_string(cpu));
+            }
+            AsyncDownloader loop(options);
+            for (size_t k = 0; k < max_in_flight; ++k) {
+                loop.spawn(worker(loop));
+            }
+            loop.run();
+        });
+    }
+    for (std::thread& loop_thread : loops) {
+        loop_thread.join();
+    }
+    logRedirectCacheUse();
+}
+
+
+// Streaming input: URLs arrive one per line on stdin ("-"), a FIFO, or any
+// number of clients of a Unix socket ("unix:/path"), and are dispatched as
+// they arrive instead of being loaded up front. SIGINT/SIGTERM stop reading;
+// transfers already dispatched still finish.
+std::atomic<bool> g_stop_requested(false);
+
+extern "C" void requestStop(int signal_number) {
+    g_stop_requested = true;
+    std::signal(signal_number, SIG_DFL);  // a second signal terminates at once
+}
+
+bool isStreamingInput(const std::string& input) {
+    std::error_code ec;
+    return input == "-" || input.rfind("unix:", 0) == 0 || std::filesystem::is_fifo(input, ec);
+}
+
+// Calls on_line for every line read until the input ends or a stop is
+// requested. stdin ends at EOF; a FIFO is held open read-write so it
+// survives writers coming and going; a socket accepts clients until stopped.
+// on_line also gets the descriptor the line came from. When on_eof is set it
+// is called as each source ends and takes ownership of its descriptor.
+void readStream(const std::string& input, const std::function<void(std::string, int)>& on_line,
+                const std::function<void(int)>& on_eof = nullptr) {
+    Logger& logger = Logger::getInstance();
+#ifdef __linux__
+    struct Source {
+        int fd;
+        std::string pending;
+    };
+    std::vector<Source> sources;
+    int listen_fd = -1;
+    std::string socket_path;
+
+    if (input == "-") {
+        sources.push_back({STDIN_FILENO, {}});
+    } else if (input.rfind("unix:", 0) == 0) {
+        socket_path = input.substr(5);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (socket_path.empty() || socket_path.size() >= sizeof(addr.sun_path)) {
+            logger.logError("Invalid Unix socket path: " + socket_path);
+            return;
+        }
+        std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(socket_path.c_str());
+        if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            listen(listen_fd, 64) != 0) {
+            logger.logError("Error listening on " + socket_path + ": " + std::strerror(errno));
+            if (listen_fd >= 0) close(listen_fd);
+            return;
+        }
+        logger.log("Accepting URLs on " + socket_path);
+    } else {
+        int fd = open(input.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            logger.logError("Error opening " + input + ": " + std::strerror(errno));
+            return;
+        }
+        sources.push_back({fd, {}});
+    }
+
+    std::vector<char> buffer(64 * 1024);
+    while (!g_stop_requested && (!sources.empty() || listen_fd >= 0)) {
+        std::vector<pollfd> fds;
+        for (const Source& source : sources) fds.push_back({source.fd, POLLIN, 0});
+        if (listen_fd >= 0) fds.push_back({listen_fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 250) < 0) {
+            if (errno == EINTR) continue;
+            logger.logError(std::string("Error polling input: ") + std::strerror(errno));
+            break;
+        }
+
+        for (size_t i = sources.size(); i-- > 0;) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            Source& source = sources[i];
+            ssize_t n = read(source.fd, buffer.data(), buffer.size());
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if (n > 0) {
+                source.pending.append(buffer.data(), static_cast<size_t>(n));
+                size_t start = 0;
+                for (size_t newline; (newline = source.pending.find('\n', start)) != std::string::npos; start = newline + 1) {
+                    on_line(source.pending.substr(start, newline - start), source.fd);
+                }
+                source.pending.erase(0, start);
+                continue;
+            }
+            // EOF or a read error: a final unterminated line still counts.
+            if (!source.pending.empty()) on_line(std::move(source.pending), source.fd);
+            if (on_eof) on_eof(source.fd);
+            else if (source.fd != STDIN_FILENO) close(source.fd);
+            sources.erase(sources.begin() + static_cast<std::ptrdiff_t>(i));
+        }
+
+        if (listen_fd >= 0 && (fds.back().revents & POLLIN)) {
+            int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) sources.push_back({client, {}});
+        }
+    }
+
+    for (const Source& source : sources) {
+        if (on_eof) on_eof(source.fd);
+        else if (source.fd != STDIN_FILENO) close(source.fd);
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(socket_path.c_str());
+    }
+#else
+    if (input != "-") {
+        logger.logError("Streaming from FIFOs and sockets is only supported on Linux: " + input);
+        return;
+    }
+    std::string line;
+    while (!g_stop_requested && std::getline(std::cin, line)) {
+        on_line(line, 0);
+    }
+    if (on_eof) on_eof(0);
+#endif
+}
+
+// Output paths for a stream, assigned one URL at a time by the reader
+// thread. Directories are created the first time they are seen and the
+// index grows a line per URL.
+class StreamingOutputs {
+public:
+    explicit StreamingOutputs(const OutputOptions& output) : output_(output) {
+        const std::filesystem::path root(output.directory);
+        createDirectory(root);
+        if (!output.index_file.empty()) {
+            index_.open(root / output.index_file, std::ios::trunc);
+            if (!index_) Logger::getInstance().logError("Error writing index file: " + (root / output.index_file).string());
+        }
+    }
+
+    std::string assign(const std::string& url) {
+        std::filesystem::path path = outputPathFor(url, ++count_, output_);
+        createDirectory(path.parent_path());
+        if (index_.is_open()) index_ << url << '\t' << path.string() << std::endl;
+        return path.string();
+    }
+
+private:
+    void createDirectory(const std::filesystem::path& dir) {
+        if (!created_.insert(dir.string()).second) return;
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec) Logger::getInstance().logError("Error creating directory " + dir.string() + ": " + ec.message());
+    }
+
+    const OutputOptions& output_;
+    size_t count_ = 0;
+    std::unordered_set<std::string> created_;
+    std::ofstream index_;
+};
+
+// Downloads URLs submitted one at a time, on either engine, until finish().
+// The thread engine enqueues straight onto its pool; for the async engine a
+// dispatcher coroutine on each event loop drains a shared queue whenever the
+// loop has a free transfer slot, polling the queue while idle. done, when
+// set, is called with each result on the worker thread or event loop that
+// produced it.
+class StreamEngine {
+public:
+    using Done = std::function<void(const DownloadResult&)>;
+
+    explicit StreamEngine(const DownloadOptions& options) : options_(options) {
+        Logger& logger = Logger::getInstance();
+        std::vector<int> cpus;
+        if (options.pin_workers) cpus = CpuTopology::detect().cpus;
+
+        if (options.engine == DownloadOptions::Engine::Threads) {
+            const size_t NUM_THREADS = options.threads > 0 ? options.threads : std::max(4U, std::thread::hardware_concurrency() * 2);
+            logger.log("Streaming engine: " + std::to_string(NUM_THREADS) + " threads.");
+            pool_ = std::make_unique<ThreadPool>(NUM_THREADS, cpus);
+            return;
+        }
+
+        const size_t num_loops = cpus.empty() ? options.event_loops : cpus.size();
+        logger.log("Streaming engine: " + std::to_string(num_loops) + " event loops, " +
+                   std::to_string(options.max_in_flight) + " transfers each.");
+        for (size_t t = 0; t < num_loops; ++t) {
+            int cpu = cpus.empty() ? -1 : cpus[t];
+            loops_.emplace_back([this, cpu] {
+                if (cpu >= 0 && !pinCurrentThread(cpu)) {
+                    Logger::getInstance().logError("Could not pin event loop to CPU " + std::to_string(cpu));
+                }
+                AsyncDownloader loop(options_);
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    event_loops_.push_back(&loop);
+                }
+                size_t active = 0;
+                loop.spawn(dispatch(loop, active));
+                loop.run();
+                std::lock_guard<std::mutex> lock(mtx_);
+                std::erase(event_loops_, &loop);
+            });
+        }
+    }
+
+    StreamEngine(const StreamEngine&) = delete;
+    StreamEngine& operator=(const StreamEngine&) = delete;
+
+    ~StreamEngine() { finish(); }
+
+    void submit(std::string url, std::string filename, RequestSpecPtr request = nullptr, Done done = nullptr) {
+        const HostId host = hostIdOf(url);
+        if (pool_) {
+            enqueueWithHostSlot(*pool_, host, [url = std::move(url), host, filename = std::move(filename), request = std::move(request),
+                                               done = std::move(done), enqueued = Tracer::Clock::now(), &options = options_]() {
+                if constexpr (kTracingEnabled) {
+                    Tracer::getInstance().span("queue_wait", url, enqueued, Tracer::Clock::now());
+                }
+                DownloadResult result = downloadPage(url, host, filename, 0, options, nullptr, request.get());
+                if (done) done(result);
+            });
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        queue_.push({std::move(url), host, std::move(filename), std::move(request), std::move(done), Tracer::Clock::now()});
+        wakeLoops();
+    }
+
+    // Stops accepting work and returns once everything submitted is done.
+    void finish() {
+        if (pool_) {
+            Logger& logger = Logger::getInstance();
+            while (!pool_->waitForIdle(options_.stats_interval)) {
+                logger.log(formatPoolStats(pool_->stats()));
+            }
+            logger.log(formatPoolStats(pool_->stats()));
+            pool_.reset();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            closed_ = true;
+            wakeLoops();
+        }
+        for (std::thread& loop_thread : loops_) {
+            loop_thread.join();
+        }
+        loops_.clear();
+    }
+
+private:
+    struct Item {
+        std::string url;
+        HostId host;
+        std::string filename;
+        RequestSpecPtr request;
+        Done done;
+        Tracer::Clock::time_point enqueued;
+    };
+
+    Task<void> transfer(AsyncDownloader& loop, Item item, size_t& active) {
+        if constexpr (kTracingEnabled) {
+            Tracer::getInstance().span("queue_wait", item.url, item.enqueued, Tracer::Clock::now());
+        }
+        DownloadResult result = co_await downloadPageAsync(loop, item.url, item.host, item.filename, 0, options_, item.request);
+        if (item.done) item.done(result);
+        if (active-- == options_.max_in_flight) loop.wakeup();  // dispatch() was waiting for room
+    }
+
+    // Called with mtx_ held.
+    void wakeLoops() {
+        for (AsyncDownloader* loop : event_loops_) loop->wakeup();
+    }
+
+    Task<void> dispatch(AsyncDownloader& loop, size_t& active) {
+        while (true) {
+            std::optional<Item> item;
+            bool drained = false;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                if (active < options_.max_in_flight && !queue_.empty()) {
+                    item = std::move(queue_.front());
+                    queue_.pop();
+                }
+                drained = closed_ && queue_.empty();
+            }
+            if (item) {
+                ++active;
+                loop.spawn(transfer(loop, std::move(*item), active));
+                continue;
+            }
+            if (drained) co_return;
+            co_await loop.waitForWakeup();  // woken by submit(), finish() or a finished transfer
+        }
+    }
+
+    const DownloadOptions& options_;
+    std::unique_ptr<ThreadPool> pool_;
+    std::vector<std::thread> loops_;
+    std::mutex mtx_;
+    std::queue<Item> queue_;
+    std::vector<AsyncDownloader*> event_loops_;  // running ones, for wakeLoops()
+    bool closed_ = false;
+};
+
+// Parses one input line (see parseInputLine()) into its URL and request,
+// assigns the output file and sets fetch_url to the URL after the redirect
+// cache. On failure error says why and url is left as read.
+bool acceptStreamedURL(std::string& url, std::string& fetch_url, RequestSpecPtr& request, std::string& filename,
+                       StreamingOutputs& outputs, std::string& error) {
+    if (!parseInputLine(url, request, error)) return false;
+    filename = outputs.assign(url);
+    fetch_url = RedirectCache::getInstance().resolve(url);
+    return true;
+}
+
+// Streaming counterpart of downloadAll()/downloadAllAsync(). The probe pass
+// needs the whole list, so it does not apply here.
+void downloadStream(const DownloadOptions& options) {
+    Logger& logger = Logger::getInstance();
+    StreamingOutputs outputs(options.output);
+    StreamEngine engine(options);
+    logger.log("Reading URLs from " + options.input_file);
+    readStream(options.input_file, [&](std::string url, int) {
+        std::string fetch_url, filename, error;
+        RequestSpecPtr request;
+        if (acceptStreamedURL(url, fetch_url, request, filename, outputs, error)) {
+            engine.submit(std::move(fetch_url), std::move(filename), std::move(request));
+        } else if (!trim(url).empty()) {
+            logger.log("Invalid input line skipped (" + error + "): " + url);
+        }
+    });
+    engine.finish();
+}
+
+// Daemon mode: one warm engine (thread pool or event loops, plus the shared
+// DNS/TLS/connection cache) serves jobs from a Unix socket until SIGINT or
+// SIGTERM. A job is one client connection: it writes URLs one per line and
+// gets one JSON result line back per URL, in completion order, carrying the
+// URL as submitted. Once the client shuts down its sending side and its last
+// URL finishes, the connection is closed.
+void runDaemon(const DownloadOptions& options) {
+    Logger& logger = Logger::getInstance();
+#ifdef __linux__
+    struct Job {
+        std::mutex mtx;
+        int fd = -1;
+        size_t pending = 0;
+        bool input_done = false;
+        bool broken = false;
+
+        // Both called with mtx held.
+        void send(const std::string& line) {
+            for (size_t sent = 0; !broken && sent < line.size();) {
+                ssize_t n = ::send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) broken = true;
+                else sent += static_cast<size_t>(n);
+            }
+        }
+        void closeIfFinished() {
+            if (input_done && pending == 0 && fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    };
+
+    StreamingOutputs outputs(options.output);
+    StreamEngine engine(options);
+    std::unordered_map<int, std::shared_ptr<Job>> jobs;  // by descriptor; touched only by this thread
+    auto jobFor = [&](int fd) -> std::shared_ptr<Job>& {
+        std::shared_ptr<Job>& job = jobs[fd];
+        if (!job) {
+            job = std::make_shared<Job>();
+            job->fd = fd;
+        }
+        return job;
+    };
 
-    for (size_t i = 0; i < urls.size(); ++i) {
-        pool.enqueue([url = urls[i], filename_str = "page" + std::to_string(i + 1) + ".html", total_urls_count = urls.size()]() {
-            downloadPage(url, filename_str, total_urls_count);
+    logger.log("Daemon listening on " + options.daemon_socket);
+    readStream(
+        "unix:" + options.daemon_socket,
+        [&](std::string url, int fd) {
+            std::shared_ptr<Job> job = jobFor(fd);
+            std::string fetch_url, filename, error;
+            RequestSpecPtr request;
+            if (!acceptStreamedURL(url, fetch_url, request, filename, outputs, error)) {
+                if (trim(url).empty()) return;
+                std::lock_guard<std::mutex> lock(job->mtx);
+                job->send(DownloadResult{url, {}, false, 0, 0, error, std::chrono::steady_clock::now(), ErrorClass::Rejected}
+                              .toJson() + "\n");
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(job->mtx);
+                ++job->pending;
+            }
+            // Results echo the submitted URL; the fetched one may be a
+            // redirect-cache or HSTS rewrite the client never saw.
+            auto done = [job, url = std::move(url)](const DownloadResult& result) {
+                DownloadResult echoed = result;
+                echoed.url = url;
+                std::lock_guard<std::mutex> lock(job->mtx);
+                job->send(echoed.toJson() + "\n");
+                --job->pending;
+                job->closeIfFinished();
+            };
+            engine.submit(std::move(fetch_url), std::move(filename), std::move(request), std::move(done));
+        },
+        [&](int fd) {
+            std::shared_ptr<Job> job = jobFor(fd);
+            jobs.erase(fd);
+            std::lock_guard<std::mutex> lock(job->mtx);
+            job->input_done = true;
+            job->closeIfFinished();
         });
+    logger.log("Daemon stopping; waiting for running jobs.");
+    engine.finish();
+#else
+    logger.logError("Daemon mode needs Unix sockets and is only supported on Linux.");
+    (void)options;
+#endif
+}
+
+// Command-line and config-file handling. Every option has one spelling used
+// both as "--name=value" (or "--name value") on the command line and as
+// "name = value" in a config file; flags override the file.
+struct OptionSpec {
+    const char* name;
+    const char* help;
+    std::function<bool(DownloadOptions&, const std::string&)> apply;  // false on a malformed value
+    bool flag = false;                          // boolean: "--name" or "--name=value", never "--name value"
+    void (*clear)(DownloadOptions&) = nullptr;  // repeatable: the first flag replaces the config file's values
+};
+
+bool parseUnsigned(const std::string& text, uint64_t& value) {
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) return false;
+    errno = 0;
+    value = std::strtoull(text.c_str(), nullptr, 10);
+    return errno == 0;
+}
+
+// Accepts an optional k/m/g suffix (powers of 1024).
+bool parseByteSize(const std::string& text, uint64_t& value) {
+    if (text.empty()) return false;
+    uint64_t multiplier = 1;
+    std::string digits = text;
+    switch (std::tolower(static_cast<unsigned char>(text.back()))) {
+    case 'k': multiplier = 1ULL << 10; break;
+    case 'm': multiplier = 1ULL << 20; break;
+    case 'g': multiplier = 1ULL << 30; break;
+    default: break;
+    }
+    if (multiplier != 1) digits.pop_back();
+    if (!parseUnsigned(digits, value)) return false;
+    value *= multiplier;
+    return true;
+}
+
+bool parseBool(const std::string& text, bool& value) {
+    std::string lower = toLower(text);
+    if (lower == "true" || lower == "yes" || lower == "on" || lower == "1") { value = true; return true; }
+    if (lower == "false" || lower == "no" || lower == "off" || lower == "0") { value = false; return true; }
+    return false;
+}
+
+template <class T>
+std::function<bool(DownloadOptions&, const std::string&)> unsignedOption(T DownloadOptions::*field) {
+    return [field](DownloadOptions& options, const std::string& text) {
+        uint64_t value = 0;
+        if (!parseUnsigned(text, value)) return false;
+        options.*field = static_cast<T>(value);
+        return true;
+    };
+}
+
+// For fields nested inside DownloadOptions, reached through an accessor.
+template <class T, class Field>
+std::function<bool(DownloadOptions&, const std::string&)> nestedUnsignedOption(Field field) {
+    return [field](DownloadOptions& options, const std::string& text) {
+        uint64_t value = 0;
+        if (!parseUnsigned(text, value)) return false;
+        field(options) = static_cast<T>(value);
+        return true;
+    };
+}
+
+template <class T, class Field>
+std::function<bool(DownloadOptions&, const std::string&)> byteSizeOption(Field field) {
+    return [field](DownloadOptions& options, const std::string& text) {
+        uint64_t value = 0;
+        if (!parseByteSize(text, value)) return false;
+        field(options) = static_cast<T>(value);
+        return true;
+    };
+}
+
+std::function<bool(DownloadOptions&, const std::string&)> stringOption(std::string DownloadOptions::*field) {
+    return [field](DownloadOptions& options, const std::string& text) {
+        options.*field = text;
+        return true;
+    };
+}
+
+std::function<bool(DownloadOptions&, const std::string&)> boolOption(bool& (*field)(DownloadOptions&)) {
+    return [field](DownloadOptions& options, const std::string& text) { return parseBool(text, field(options)); };
+}
+
+const std::vector<OptionSpec>& optionSpecs() {
+    static const std::vector<OptionSpec> specs = {
+        {"input", "URL list file; '-' (stdin), a FIFO or unix:PATH streams", stringOption(&DownloadOptions::input_file)},
+        {"json-results", "print one JSON result line per URL on stdout", boolOption([](DownloadOptions& o) -> bool& { return o.json_results; }), true},
+        {"log-file", "log file (appended)", stringOption(&DownloadOptions::log_file)},
+        {"trace-file", "Chrome trace output when built with DOWNLOADER_TRACING", stringOption(&DownloadOptions::trace_file)},
+        {"engine", "threads | async", [](DownloadOptions& o, const std::string& v) {
+             if (v == "threads") o.engine = DownloadOptions::Engine::Threads;
+             else if (v == "async") o.engine = DownloadOptions::Engine::Async;
+             else return false;
+             return true;
+         }},
+        {"schedule", "fifo | longest-first (expected duration from host profiles)", [](DownloadOptions& o, const std::string& v) {
+             if (v == "fifo") o.schedule = DownloadOptions::Schedule::Fifo;
+             else if (v == "longest-first") o.schedule = DownloadOptions::Schedule::LongestFirst;
+             else return false;
+             return true;
+         }},
+        {"threads", "thread-pool workers; 0 = automatic", unsignedOption(&DownloadOptions::threads)},
+        {"event-loops", "event-loop threads for the async engine", unsignedOption(&DownloadOptions::event_loops)},
+        {"max-in-flight", "concurrent transfers per event loop", unsignedOption(&DownloadOptions::max_in_flight)},
+        {"pin-workers", "pin workers / one event loop per CPU", boolOption([](DownloadOptions& o) -> bool& { return o.pin_workers; }), true},
+        {"stats-interval", "seconds between thread-pool statistics lines", [](DownloadOptions& o, const std::string& v) {
+             uint64_t value = 0;
+             if (!parseUnsigned(v, value)) return false;
+             o.stats_interval = std::chrono::seconds(value);
+             return true;
+         }},
+        {"retries", "attempts per URL", unsignedOption(&DownloadOptions::max_retries)},
+        {"retry-delay-ms", "backoff unit; attempt n waits n times this", [](DownloadOptions& o, const std::string& v) {
+             uint64_t value = 0;
+             if (!parseUnsigned(v, value)) return false;
+             o.retry_delay = std::chrono::milliseconds(value);
+             return true;
+         }},
+        {"retry-policy", "per error class: CLASS=ATTEMPTS[:DELAY_MS]; repeatable", [](DownloadOptions& o, const std::string& v) {
+             // Classes: transient, server, client, dns, tls, local-io.
+             size_t equals = v.find('='), colon = v.find(':');
+             std::optional<ErrorClass> error_class = errorClassFromName(trim(std::string_view(v).substr(0, equals)));
+             if (equals == std::string::npos || !error_class || *error_class == ErrorClass::None ||
+                 *error_class == ErrorClass::Rejected) {
+                 return false;
+             }
+             uint64_t attempts = 0, delay_ms = 0;
+             if (!parseUnsigned(v.substr(equals + 1, colon == std::string::npos ? std::string::npos : colon - equals - 1), attempts) ||
+                 attempts < 1 || (colon != std::string::npos && !parseUnsigned(v.substr(colon + 1), delay_ms))) {
+                 return false;
+             }
+             RetryPolicy policy{static_cast<int>(std::min<uint64_t>(attempts, 100)), o.retry_delay};
+             if (colon != std::string::npos) policy.delay = std::chrono::milliseconds(delay_ms);
+             o.retry_policies[static_cast<size_t>(*error_class)] = policy;
+             return true;
+         }, false, [](DownloadOptions& o) { o.retry_policies = {}; }},
+        {"failures-file", "write failed URLs here as JSON lines usable as input", stringOption(&DownloadOptions::failures_file)},
+        {"retry-failed", "re-run only the failures recorded in this file", stringOption(&DownloadOptions::retry_failed)},
+        {"retry-classes", "error classes --retry-failed re-runs (comma-separated)", [](DownloadOptions& o, const std::string& v) {
+             std::stringstream names(v);
+             std::string name;
+             o.retry_classes.clear();
+             while (std::getline(names, name, ',')) {
+                 std::optional<ErrorClass> error_class = errorClassFromName(trim(name));
+                 if (!error_class || *error_class == ErrorClass::None) return false;
+                 o.retry_classes.push_back(*error_class);
+             }
+             return !o.retry_classes.empty();
+         }},
+        {"timeout", "whole-transfer timeout in seconds", unsignedOption(&DownloadOptions::timeout_secs)},
+        {"connect-timeout", "connect timeout in seconds; 0 = libcurl default", unsignedOption(&DownloadOptions::connect_timeout_secs)},
+        {"low-speed-limit", "abort below this many bytes/s ...", unsignedOption(&DownloadOptions::low_speed_limit)},
+        {"low-speed-time", "... for this many seconds", unsignedOption(&DownloadOptions::low_speed_time)},
+        {"adaptive-timeouts", "derive per-host timeouts from the host profiles",
+         boolOption([](DownloadOptions& o) -> bool& { return o.adaptive_timeouts; }), true},
+        {"max-timeout", "cap in seconds on a timeout stretched for a large body", unsignedOption(&DownloadOptions::max_timeout_secs)},
+        {"output-dir", "directory for downloaded files", [](DownloadOptions& o, const std::string& v) {
+             o.output.directory = v;
+             return !v.empty();
+         }},
+        {"layout", "flat | hash | host", [](DownloadOptions& o, const std::string& v) {
+             if (v == "flat") o.output.layout = OutputOptions::Layout::Flat;
+             else if (v == "hash") o.output.layout = OutputOptions::Layout::HashSharded;
+             else if (v == "host") o.output.layout = OutputOptions::Layout::ByHost;
+             else return false;
+             return true;
+         }},
+        {"shard-levels", "directory levels for the hash layout", nestedUnsignedOption<size_t>([](DownloadOptions& o) -> size_t& { return o.output.shard_levels; })},
+        {"url-names", "name files after their URL", boolOption([](DownloadOptions& o) -> bool& { return o.output.url_names; }), true},
+        {"index-file", "URL-to-path index under output-dir; empty disables", [](DownloadOptions& o, const std::string& v) {
+             o.output.index_file = v;
+             return true;
+         }},
+        {"allow-type", "accepted media type; repeatable or comma-separated", [](DownloadOptions& o, const std::string& v) {
+             std::stringstream types(v);
+             std::string type;
+             while (std::getline(types, type, ',')) {
+                 std::string media_type = toLower(std::string(trim(type)));
+                 if (!media_type.empty()) o.filter.allowed_content_types.push_back(media_type);
+             }
+             return true;
+         }, false, [](DownloadOptions& o) { o.filter.allowed_content_types.clear(); }},
+        {"max-content-length", "reject larger Content-Length (k/m/g)",
+         byteSizeOption<curl_off_t>([](DownloadOptions& o) -> curl_off_t& { return o.filter.max_content_length; })},
+        {"max-body-bytes", "abort bodies larger than this (k/m/g)",
+         byteSizeOption<size_t>([](DownloadOptions& o) -> size_t& { return o.filter.max_body_bytes; })},
+        {"probe", "HEAD-probe the list and plan before downloading (threads engine)", boolOption([](DownloadOptions& o) -> bool& { return o.probe.enabled; }), true},
+        {"probe-concurrency", "concurrent probes", nestedUnsignedOption<size_t>([](DownloadOptions& o) -> size_t& { return o.probe.concurrency; })},
+        {"segment-threshold", "segment objects at least this large (k/m/g)",
+         byteSizeOption<curl_off_t>([](DownloadOptions& o) -> curl_off_t& { return o.probe.segment_threshold; })},
+        {"max-segments", "ranged segments per large object", nestedUnsignedOption<size_t>([](DownloadOptions& o) -> size_t& { return o.probe.max_segments; })},
+        {"small-object-bytes", "batch objects up to this size (k/m/g)",
+         byteSizeOption<curl_off_t>([](DownloadOptions& o) -> curl_off_t& { return o.probe.small_object_bytes; })},
+        {"small-batch-size", "small objects per batch", nestedUnsignedOption<size_t>([](DownloadOptions& o) -> size_t& { return o.probe.small_batch_size; })},
+        {"redirect-cache", "redirect cache file; empty disables", stringOption(&DownloadOptions::redirect_cache_file)},
+        {"redirect-cache-ttl", "seconds a cached redirect stays valid", [](DownloadOptions& o, const std::string& v) {
+             uint64_t value = 0;
+             if (!parseUnsigned(v, value)) return false;
+             o.redirect_cache_ttl = std::chrono::seconds(value);
+             return true;
+         }},
+        {"hsts-cache", "HSTS cache file; empty disables", stringOption(&DownloadOptions::hsts_cache_file)},
+        {"altsvc-cache", "Alt-Svc cache file; empty disables", stringOption(&DownloadOptions::altsvc_cache_file)},
+        {"host-profiles", "per-host transfer history file; empty disables", stringOption(&DownloadOptions::host_profiles_file)},
+        {"max-open-files", "output files open at once; 0 = half of RLIMIT_NOFILE", unsignedOption(&DownloadOptions::max_open_files)},
+        {"max-rate", "total receive rate in bytes/s (k/m/g); 0 = unlimited",
+         byteSizeOption<curl_off_t>([](DownloadOptions& o) -> curl_off_t& { return o.max_bytes_per_sec; })},
+        {"share-connections", "share DNS and TLS-session caches across all handles; workers keep warm connections",
+         boolOption([](DownloadOptions& o) -> bool& { return o.share_connections; }), true},
+        {"proxy", "add a pool proxy: URL[,max=N][,weight=W]; repeatable", [](DownloadOptions& o, const std::string& v) {
+             std::stringstream fields(v);
+             std::string field;
+             ProxyPool::Proxy proxy;
+             std::getline(fields, proxy.url, ',');
+             proxy.url = std::string(trim(proxy.url));
+             if (proxy.url.empty()) return false;
+             while (std::getline(fields, field, ',')) {
+                 std::string_view setting = trim(field);
+                 uint64_t value = 0;
+                 if (setting.rfind("max=", 0) == 0 && parseUnsigned(std::string(setting.substr(4)), value)) {
+                     proxy.max_concurrency = value;
+                 } else if (setting.rfind("weight=", 0) == 0) {
+                     char* end = nullptr;
+                     std::string text(setting.substr(7));
+                     proxy.weight = std::strtod(text.c_str(), &end);
+                     if (text.empty() || *end != '\0' || !(proxy.weight > 0)) return false;
+                 } else {
+                     return false;
+                 }
+             }
+             o.proxies.push_back(proxy);
+             return true;
+         }, false, [](DownloadOptions& o) { o.proxies.clear(); }},
+        {"cookies", "keep one cookie jar shared by all workers", boolOption([](DownloadOptions& o) -> bool& { return o.cookies; }), true},
+        {"cookie-jar", "load and save the shared cookie jar in this file", stringOption(&DownloadOptions::cookie_jar_file)},
+        {"daemon", "serve jobs on this Unix socket path instead of reading input", stringOption(&DownloadOptions::daemon_socket)},
+        {"max-host-rate", "per-host receive rate in bytes/s (k/m/g); 0 = unlimited",
+         byteSizeOption<curl_off_t>([](DownloadOptions& o) -> curl_off_t& { return o.max_host_bytes_per_sec; })},
+        {"max-per-host", "concurrent transfers per host; 0 = unlimited (rate limiting still lowers it)",
+         unsignedOption(&DownloadOptions::max_per_host)},
+        {"hedge", "duplicate GET/HEAD requests still waiting past the host's TTFB percentile",
+         boolOption([](DownloadOptions& o) -> bool& { return o.hedge; }), true},
+        {"hedge-percentile", "TTFB percentile (1-99) after which a request is hedged", unsignedOption(&DownloadOptions::hedge_percentile)},
+        {"hedge-min-samples", "TTFB samples a host needs before its requests are hedged",
+         unsignedOption(&DownloadOptions::hedge_min_samples)},
+    };
+    return specs;
+}
+
+void printUsage(const char* program) {
+    std::cout << "Usage: " << program << " [--config FILE] [--name=value ...]\n\nOptions:\n";
+    for (const OptionSpec& spec : optionSpecs()) {
+        std::cout << "  --" << std::left << std::setw(22) << spec.name << spec.help << "\n";
+    }
+    std::cout << "\nA config file holds the same options as \"name = value\" lines; '#' starts a comment.\n";
+}
+
+const OptionSpec* findOption(const std::string& name) {
+    for (const OptionSpec& spec : optionSpecs()) {
+        if (name == spec.name) return &spec;
+    }
+    return nullptr;
+}
+
+bool applyOption(DownloadOptions& options, const std::string& name, const std::string& value, std::string& error) {
+    const OptionSpec* spec = findOption(name);
+    if (!spec) {
+        error = "unknown option: " + name;
+        return false;
+    }
+    if (!spec->apply(options, value)) {
+        error = "invalid value for " + name + ": '" + value + "'";
+        return false;
+    }
+    return true;
+}
+
+bool loadConfigFile(DownloadOptions& options, const std::string& filename, std::string& error) {
+    std::ifstream file(filename);
+    if (!file) {
+        error = "cannot read config file: " + filename;
+        return false;
+    }
+    std::string line;
+    for (int line_number = 1; std::getline(file, line); ++line_number) {
+        std::string_view content = trim(std::string_view(line).substr(0, line.find('#')));
+        if (content.empty()) continue;
+        size_t equals = content.find('=');
+        if (equals == std::string_view::npos) {
+            error = filename + ":" + std::to_string(line_number) + ": expected name = value";
+            return false;
+        }
+        std::string name(trim(content.substr(0, equals)));
+        std::string value(trim(content.substr(equals + 1)));
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') value = value.substr(1, value.size() - 2);
+        if (!applyOption(options, name, value, error)) {
+            error = filename + ":" + std::to_string(line_number) + ": " + error;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool validateOptions(const DownloadOptions& options, std::string& error) {
+    if (options.input_file.empty()) error = "input must not be empty";
+    else if (options.max_retries < 1) error = "retries must be at least 1";
+    else if (options.timeout_secs < 1) error = "timeout must be at least 1 second";
+    else if (options.max_timeout_secs < options.timeout_secs) error = "max-timeout must be at least timeout";
+    else if (options.event_loops < 1) error = "event-loops must be at least 1";
+    else if (options.max_in_flight < 1) error = "max-in-flight must be at least 1";
+    else if (options.stats_interval.count() < 1) error = "stats-interval must be at least 1 second";
+    else if (options.output.shard_levels < 1 || options.output.shard_levels > 8) error = "shard-levels must be 1-8";
+    else if (options.probe.enabled && options.engine == DownloadOptions::Engine::Async) error = "probe requires the threads engine";
+    else if (options.probe.concurrency < 1) error = "probe-concurrency must be at least 1";
+    else if (options.probe.max_segments < 1) error = "max-segments must be at least 1";
+    else if (options.hedge_percentile < 1 || options.hedge_percentile > 99) error = "hedge-percentile must be 1-99";
+    else return true;
+    return false;
+}
+
+// Config file first (wherever --config appears), then flags in order, so a
+// flag overrides the file; a repeatable option given as a flag replaces the
+// file's values instead of adding to them. Boolean options take a value only
+// as --name=value. Sets show_help for --help/-h and returns false with error
+// on bad input.
+bool parseOptions(int argc, char* argv[], DownloadOptions& options, bool& show_help, std::string& error) {
+    show_help = false;
+    std::vector<std::pair<std::string, std::string>> flags;
+    std::string config_file;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            show_help = true;
+            return true;
+        }
+        if (arg.rfind("--", 0) != 0) {
+            error = "unexpected argument: " + arg;
+            return false;
+        }
+        std::string name = arg.substr(2), value;
+        size_t equals = name.find('=');
+        const OptionSpec* spec = nullptr;
+        if (equals != std::string::npos) {
+            value = name.substr(equals + 1);
+            name.erase(equals);
+        } else if ((spec = findOption(name)) && spec->flag) {
+            value = "true";
+        } else if (i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0) {
+            value = argv[++i];
+        } else {
+            error = "missing value for --" + name;
+            return false;
+        }
+        if (name == "config") {
+            config_file = value;
+        } else {
+            flags.emplace_back(name, value);
+        }
+    }
+    if (!config_file.empty() && !loadConfigFile(options, config_file, error)) return false;
+    std::unordered_set<std::string> replaced;
+    for (const auto& [name, value] : flags) {
+        const OptionSpec* spec = findOption(name);
+        if (spec && spec->clear && replaced.insert(name).second) spec->clear(options);
+        if (!applyOption(options, name, value, error)) return false;
     }
+    return validateOptions(options, error);
 }
 
+int main(int argc, char* argv[]) {
+    DownloadOptions parsed;
+    bool show_help = false;
+    std::string option_error;
+    if (!parseOptions(argc, argv, parsed, show_help, option_error)) {
+        std::cerr << option_error << "\nTry '" << argv[0] << " --help'." << std::endl;
+        return 2;
+    }
+    if (show_help) {
+        printUsage(argv[0]);
+        return 0;
+    }
+    const DownloadOptions& options = parsed;
 
-int main() {
+    const bool daemon = !options.daemon_socket.empty();
+    const bool retrying = !daemon && !options.retry_failed.empty();
+    const bool streaming = !daemon && !retrying && isStreamingInput(options.input_file);
     Logger& logger = Logger::getInstance();
-    logger.openLogFile("errors_and_logs.log");
+    logger.openLogFile(options.log_file);
+    if (streaming || options.json_results) {
+        logger.setConsole(std::cerr);
+        ResultWriter::getInstance().enable();
+    }
 
     curl_global_init(CURL_GLOBAL_ALL);
 
-    std::vector<std::string> urls = loadURLs("urls.txt");
-    if (urls.empty()) {
-        logger.log("No valid URLs found. Exiting.");
-        curl_global_cleanup();
-        return 1;
+    if (!options.failures_file.empty() && !FailureLog::getInstance().open(options.failures_file)) {
+        logger.logError("Error opening failures file: " + options.failures_file);
+    }
+    UrlTable urls;
+    std::vector<RequestSpecPtr> requests;
+    if (!streaming && !daemon) {
+        if (retrying) {
+            logger.log("Retrying failures from " + options.retry_failed);
+            urls = loadURLs(options.retry_failed, &requests, &options.retry_classes);
+        } else {
+            urls = loadURLs(options.input_file, &requests);
+        }
+        if (urls.empty()) {
+            logger.log("No valid URLs found. Exiting.");
+            FailureLog::getInstance().close();
+            curl_global_cleanup();
+            return 1;
+        }
+        logger.log("Loaded " + std::to_string(urls.size()) + " URLs (" + std::to_string(urls.memoryBytes() / 1024) +
+                   " KiB).");
+    }
+
+    FdBudget::getInstance().setCapacity(options.max_open_files);
+    BandwidthLimiter::getInstance().configure(options.max_bytes_per_sec, options.max_host_bytes_per_sec);
+    if (!options.redirect_cache_file.empty()) {
+        RedirectCache::getInstance().load(options.redirect_cache_file, options.redirect_cache_ttl);
+    }
+    if (!options.hsts_cache_file.empty()) {
+        HstsStore::getInstance().load(options.hsts_cache_file);
+    }
+    if (!options.altsvc_cache_file.empty()) {
+        AltSvcStore::getInstance().load(options.altsvc_cache_file);
+    }
+    HostProfiles& profiles = HostProfiles::getInstance();
+    if (!options.host_profiles_file.empty()) {
+        profiles.load(options.host_profiles_file);
+        const std::vector<HostProfiles::Buckets> histograms = profiles.ttfbHistograms();
+        for (HostId host = 0; host < histograms.size(); ++host) {
+            TtfbTracker::getInstance().seed(host, histograms[host]);
+        }
+    }
+    HostLimiter::getInstance().configure(options.max_per_host, profiles.concurrencyLimits());
+    ProxyPool::getInstance().configure(options.proxies);
+    TtfbTracker::getInstance().configure(options.hedge, options.hedge_percentile, options.hedge_min_samples);
+    CurlShare::getInstance().enable(daemon || options.share_connections,
+                                    options.cookies || !options.cookie_jar_file.empty(), options.cookie_jar_file);
+
+    if (daemon || streaming) {
+        std::signal(SIGINT, requestStop);
+        std::signal(SIGTERM, requestStop);
+    }
+    if (daemon) {
+        runDaemon(options);
+    } else if (streaming) {
+        downloadStream(options);
+    } else if (options.engine == DownloadOptions::Engine::Async) {
+        downloadAllAsync(urls, options, requests);
+    } else {
+        downloadAll(urls, options, requests);
     }
 
-    downloadAll(urls);
+    if (!RedirectCache::getInstance().save(options.redirect_cache_file)) {
+        logger.logError("Error writing redirect cache: " + options.redirect_cache_file);
+    }
+    if (!AltSvcStore::getInstance().save(options.altsvc_cache_file)) {
+        logger.logError("Error writing Alt-Svc cache: " + options.altsvc_cache_file);
+    }
+    if (!options.hsts_cache_file.empty() && !HstsStore::getInstance().save(options.hsts_cache_file)) {
+        logger.logError("Error writing HSTS cache: " + options.hsts_cache_file);
+    }
+    profiles.updateConcurrencyLimits(HostLimiter::getInstance().throttledHosts());
+    if (!profiles.save(options.host_profiles_file)) {
+        logger.logError("Error writing host profiles: " + options.host_profiles_file);
+    }
+    logger.log(ErrorCounters::getInstance().summary());
+    long failures_written = FailureLog::getInstance().close();
+    if (failures_written < 0) {
+        logger.logError("Error writing failures file: " + options.failures_file);
+    } else if (!options.failures_file.empty()) {
+        logger.log(std::to_string(failures_written) + " failed URLs written to " + options.failures_file);
+    }
+    if (options.hedge) logger.log(TtfbTracker::getInstance().summary());
+    for (const std::string& line : ProxyPool::getInstance().summary()) {
+        logger.log(line);
+    }
+    if (!CurlShare::getInstance().saveCookies()) {
+        logger.logError("Error writing cookie jar: " + options.cookie_jar_file);
+    }
 
     logger.log("All download tasks dispatched. Waiting for completion...");
+    if constexpr (kTracingEnabled) {
+        if (!Tracer::getInstance().writeChromeTrace(options.trace_file)) {
+            logger.logError("Error writing trace file: " + options.trace_file);
+        }
+    }
+    CurlShare::getInstance().cleanup();
     curl_global_cleanup(); 
     logger.log("Program finished.");
     return 0;
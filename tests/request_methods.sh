@@ -0,0 +1,80 @@
+#!/bin/sh
+# Checks that JSON input lines are sent with the method they ask for, with and
+# without a body, on both engines. Requests go through a local echo server
+# acting as the pool proxy, so no network access is needed.
+#
+#   tests/request_methods.sh [path/to/multi_downloader]
+set -eu
+
+BIN=$(cd "$(dirname "${1:-./multi_downloader}")" && pwd)/$(basename "${1:-./multi_downloader}")
+WORK=$(mktemp -d)
+trap 'kill "$SERVER" 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+cd "$WORK"
+
+cat > echo.py <<'EOF'
+import http.server, json, sys
+class Echo(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    def log_message(self, *args): pass
+    def reply(self):
+        length = int(self.headers.get("Content-Length") or 0)
+        body = self.rfile.read(length).decode() if length else ""
+        out = json.dumps({"method": self.command, "body": body}).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(out)))
+        self.end_headers()
+        if self.command != "HEAD": self.wfile.write(out)
+    do_GET = do_HEAD = do_POST = do_PUT = do_DELETE = reply
+server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), Echo)
+print(server.server_address[1], flush=True)
+server.serve_forever()
+EOF
+python3 echo.py > port &
+SERVER=$!
+while [ ! -s port ]; do sleep 0.1; done
+PROXY="--proxy=http://127.0.0.1:$(cat port)"
+
+failures=0
+# check ENGINE INPUT_LINE EXPECTED_METHOD EXPECTED_BODY
+check() {
+    printf '%s\n' "$2" > in.txt
+    rm -rf out
+    "$BIN" --input=in.txt --engine="$1" --output-dir=out --log-file=log.txt "$PROXY" \
+        --redirect-cache= --hsts-cache= --altsvc-cache= --host-profiles= > /dev/null 2>&1 || true
+    got=$(cat out/page1.html 2>/dev/null || echo missing)
+    want="{\"method\": \"$3\", \"body\": \"$4\"}"
+    if [ "$got" = "$want" ]; then
+        echo "ok   $1 $2"
+    else
+        echo "FAIL $1 $2: got $got, want $want"
+        failures=$((failures + 1))
+    fi
+}
+# reject ENGINE INPUT_LINE: the line must fail validation and never be sent
+reject() {
+    printf '%s\n' "$2" > in.txt
+    rm -rf out
+    "$BIN" --input=in.txt --engine="$1" --output-dir=out --log-file=log.txt "$PROXY" \
+        --redirect-cache= --hsts-cache= --altsvc-cache= --host-profiles= > /dev/null 2>&1 || true
+    if [ -e out/page1.html ]; then
+        echo "FAIL $1 $2: was sent"
+        failures=$((failures + 1))
+    else
+        echo "ok   $1 $2 (rejected)"
+    fi
+}
+
+for engine in threads async; do
+    check "$engine" 'http://echo.test/a' GET ''
+    check "$engine" '{"url":"http://echo.test/a"}' GET ''
+    check "$engine" '{"url":"http://echo.test/a","body":"x=1"}' POST 'x=1'
+    check "$engine" '{"url":"http://echo.test/a","method":"POST"}' POST ''
+    check "$engine" '{"url":"http://echo.test/a","method":"post","body":"x=1"}' POST 'x=1'
+    check "$engine" '{"url":"http://echo.test/a","method":"PUT","body":"x=1"}' PUT 'x=1'
+    check "$engine" '{"url":"http://echo.test/a","method":"DELETE"}' DELETE ''
+    reject "$engine" '{"url":"http://echo.test/a","method":"GET","body":"y=2"}'
+    reject "$engine" '{"url":"http://echo.test/a","method":"HEAD","body":"y=2"}'
+done
+
+[ "$failures" -eq 0 ] && echo "All request method checks passed." || { echo "$failures failed."; exit 1; }